@@ -15,6 +15,16 @@
 #include <ctype.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <regex.h>
+#include <time.h>
+#include <math.h>
+#include <linux/fs.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define RET_OK 0
 #define RET_HELP 1
@@ -24,10 +34,361 @@
 #define RET_BADARG 5
 #define RET_BADARGCOMB 6
 #define RET_PROCSCAN 7
+#define RET_NOMEM 8
+#define RET_THREAD 9
+#define RET_PAGEMAP 10
+#define RET_MAPS 11
+#define RET_NUMA 12
+#define RET_IDLE 13
+#define RET_SNAPSHOT 14
+
+#define DEF_BUFENTRIES 8192
+
+// Largest -b, keeping each per context buffer under 128MB
+#define MAX_BUFENTRIES (1 << 24)
+
+// Sections larger than this are split on aligned boundaries when scanning with -j
+#define SHARD_SIZE (1ULL << 30)
+
+// Largest PFN gap to read through when coalescing kernel page lookups
+#define KPAGE_GAP 16
+
+// Huge page handling when looking up kernel page details: every page read, heads probed
+// where the page map shows an aligned run of contiguous PFNs, or heads probed throughout a
+// region PAGEMAP_SCAN reports as huge
+#define HUGE_NONE 0
+#define HUGE_RUNS 1
+#define HUGE_REGION 2
+
+// PFNs per kernel page cache chunk (power of 2)
+#define KCACHE_SHIFT 12
+#define KCACHE_CHUNK (1 << KCACHE_SHIFT)
+
+#define KPAGE_GOTCOUNT 0x01
+#define KPAGE_GOTFLAGS 0x02
+#define KPAGE_GOTIDLE 0x04
+#define KPAGE_IDLE 0x08
+
+// Value read back for PFNs a snapshot holds no kernel page details for
+#define KPAGE_NONE UINT64_MAX
+
+#define PAGE_IDLE_BITMAP "/sys/kernel/mm/page_idle/bitmap"
+
+// Output formats
+#define OUT_TEXT 0
+#define OUT_JSON 1
+#define OUT_CSV 2
+#define OUT_BIN 3
+
+// Page map (-m) output buffer size
+#define MAPBUF_SIZE 4096
+
+// Structured output buffer size
+#define OUTBUF_SIZE 65536
+
+// Structured output record types
+#define REC_PROCESS 1
+#define REC_SECTION 2
+#define REC_TOTALS 3
+#define REC_PAGE 4
+
+// Structured output fields in CSV column order, sizes are in bytes
+#define FLD_ITERATION 1
+#define FLD_PID 2
+#define FLD_TID 3
+#define FLD_START 4
+#define FLD_END 5
+#define FLD_PERMS 6
+#define FLD_NAME 7
+#define FLD_SIZE 8
+#define FLD_PRESENT 9
+#define FLD_UNIQUE 10
+#define FLD_AVERAGE 11
+#define FLD_ANON 12
+#define FLD_REFERENCED 13
+#define FLD_HUGE 14
+#define FLD_SWAPPED 15
+#define FLD_ACCESSED 16
+#define FLD_ADDR 17
+#define FLD_PFN 18
+#define FLD_REFCNT 19
+#define FLD_FLAGS 20
+#define FLD_SWAPFILE 21
+#define FLD_SWAPOFFSET 22
+#define FLD_CMDLINE 23
+#define FLD_NODES 24
+#define FLD_COUNT 25
+
+// Binary output stream signature
+#define OUTBIN_MAGIC "PageMap\x01"
+
+// Snapshot file signature and version
+#define SNAP_MAGIC "PMSNAP\x00\x00"
+#define SNAP_VERSION 1
+
+// Snapshot header flags
+#define SNAP_KPAGECOUNT 0x01
+#define SNAP_KPAGEFLAGS 0x02
+
+// Snapshot extent entry for pages whose page map entries couldn't be read
+#define SNAP_UNREADABLE UINT64_MAX
+
+// Most huge page sizes tracked
+#define MAX_HUGESIZES 8
+
+// Reverse PFN index runs buffered per scan before adding to the shared index
+#define XREF_BATCH 1024
+
+// Reverse PFN index queries
+#define XREF_TOP 1
+#define XREF_PFN 2
+#define XREF_VMA 3
+
+// NUMA nodes broken down in statistics
+#define MAX_NODES 64
+#define NODE_SYSFS "/sys/devices/system/node"
+#define MEMORY_BLOCK_SIZE "/sys/devices/system/memory/block_size_bytes"
+
+// Kernel page entries read per block when scanning all physical memory
+#define PHYS_BLOCK 65536
+
+// Zones listed from /proc/zoneinfo
+#define MAX_ZONES 64
+#define ZONEINFO "/proc/zoneinfo"
+
+// Kernel page flag bits
+#define KPF_LRU 5
+#define KPF_SLAB 7
+#define KPF_BUDDY 10
+#define KPF_ANON 12
+#define KPF_NOPAGE 20
+
+// Process grouping for -G
+#define GROUP_UID 1
+#define GROUP_CGROUP 2
+#define GROUP_TREE 3
+
+// Maximum group name length
+#define MAX_GROUPNAME 256
+
+// Default number of sharing groups listed
+#define XREF_TOPN 20
+
+// Self profile phases for -T
+#define PROF_PROCS 0
+#define PROF_MAPS 1
+#define PROF_PAGEMAP 2
+#define PROF_KPAGECOUNT 3
+#define PROF_KPAGEFLAGS 4
+#define PROF_PAGEIDLE 5
+#define PROF_CMDLINE 6
+#define PROF_OUTPUT 7
+#define PROF_COUNT 8
+
+// Slowest processes listed in the self profile
+#define PROF_TOPN 10
+
+// Process ranking for -k
+#define TOP_PRESENT 1
+#define TOP_PRIVATE 2
+#define TOP_SWAPPED 3
+#define TOP_ANON 4
+#define TOP_HUGE 5
+
+// Default number of processes listed by -k
+#define TOP_DEFAULT 10
+
+// Pages the kernel's memory counters can lag by for -k, they are batched per CPU (at least
+// 32 pages, twice the CPU count on large systems) or per thread on older kernels
+#define TOP_CPUBATCH 32
+#define TOP_THREADBATCH 64
+
+// Pages in each unit read by -e, 2MB aligned so huge pages fall in one unit
+#define EST_UNIT 512
+
+// Figures given confidence intervals by -e
+#define EST_PRESENT 0
+#define EST_PRIVATE 1
+#define EST_ANON 2
+#define EST_HUGE 3
+#define EST_SWAPPED 4
+#define EST_FIELDS 5
+
+// Normal quantile for the 95% intervals printed with -e
+#define EST_Z 1.96
+
+// Maps text read size and first buffer size
+#define MAPS_READ 65536
+#define MAPS_BUFSIZE (4 * MAPS_READ)
+
+// Page map regions returned per PAGEMAP_SCAN call
+#define PMSCAN_REGIONS 1024
+
+#ifndef PAGEMAP_SCAN
+// PAGEMAP_SCAN ioctl from Linux/include/uapi/linux/fs.h (6.7+)
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+
+#define PAGE_IS_WPALLOWED  (1 << 0)
+#define PAGE_IS_WRITTEN    (1 << 1)
+#define PAGE_IS_FILE       (1 << 2)
+#define PAGE_IS_PRESENT    (1 << 3)
+#define PAGE_IS_SWAPPED    (1 << 4)
+#define PAGE_IS_PFNZERO    (1 << 5)
+#define PAGE_IS_HUGE       (1 << 6)
+#define PAGE_IS_SOFT_DIRTY (1 << 7)
+
+struct page_region{
+	uint64_t start;
+	uint64_t end;
+	uint64_t categories;
+};
+
+struct pm_scan_arg{
+	uint64_t size;
+	uint64_t flags;
+	uint64_t start;
+	uint64_t end;
+	uint64_t walk_end;
+	uint64_t vec;
+	uint64_t vec_len;
+	uint64_t max_pages;
+	uint64_t category_inverted;
+	uint64_t category_mask;
+	uint64_t category_anyof_mask;
+	uint64_t return_mask;
+};
+#endif
+
+#ifndef PROCMAP_QUERY
+// PROCMAP_QUERY ioctl from Linux/include/uapi/linux/fs.h (6.11+)
+#define PROCMAP_QUERY _IOWR('f', 17, struct procmap_query)
+
+#define PROCMAP_QUERY_VMA_READABLE         0x01
+#define PROCMAP_QUERY_VMA_WRITABLE         0x02
+#define PROCMAP_QUERY_VMA_EXECUTABLE       0x04
+#define PROCMAP_QUERY_VMA_SHARED           0x08
+#define PROCMAP_QUERY_COVERING_OR_NEXT_VMA 0x10
+#define PROCMAP_QUERY_FILE_BACKED_VMA      0x20
+
+struct procmap_query{
+	uint64_t size;
+	uint64_t query_flags;
+	uint64_t query_addr;
+	uint64_t vma_start;
+	uint64_t vma_end;
+	uint64_t vma_flags;
+	uint64_t vma_page_size;
+	uint64_t vma_offset;
+	uint64_t inode;
+	uint32_t dev_major;
+	uint32_t dev_minor;
+	uint32_t vma_name_size;
+	uint32_t build_id_size;
+	uint64_t vma_name_addr;
+	uint64_t build_id_addr;
+};
+#endif
+
+#define PM_PRESENT 0x8000000000000000LL
+#define PM_SWAPPED 0x4000000000000000LL
+#define PM_PFN     0x007fffffffffffffLL
+
+// Snapshot file layout. All sections are 8 byte aligned and in host byte order so the
+// file can be mapped and used directly
+struct snaphdr{
+	char magic[8];
+	uint32_t version;
+	uint32_t pagesize;
+	uint64_t pid;
+	uint64_t tid;
+	uint64_t time;
+	uint64_t flags;
+	uint64_t mapsoff;
+	uint64_t mapslen;
+	uint64_t extoff;
+	uint64_t nexts;
+	uint64_t kpoff;
+	uint64_t nkps;
+};
+
+// Run of pages with page map entries entry, entry + step, ... (see snap_step). Pages with
+// no entry are omitted. Extents are in address order, SNAP_UNREADABLE marks pages the
+// page map couldn't be read for
+struct snapext{
+	uint64_t addr;
+	uint64_t pages;
+	uint64_t entry;
+};
+
+// Run of PFNs with the same kernel page count and flags, in PFN order
+struct snapkp{
+	uint64_t pfn;
+	uint64_t pfns;
+	uint64_t count;
+	uint64_t flags;
+};
+
+struct snapshot{
+	int hfile;
+	char *base;
+	size_t size;
+	struct snaphdr *hdr;
+	struct snapext *exts;
+	struct snapkp *kps;
+};
+
+// Counts from decoding a block of page map entries
+struct pmcounts{
+	uint64_t present;
+	uint64_t swapped;
+};
+
+// Page map decoder, returns the number of present or swapped entries with their indexes in data
+typedef uint64_t (*pmdecode_t)(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts);
+
+// Time, calls and bytes for one phase of a scan
+struct profphase{
+	uint64_t ns;
+	uint64_t calls;
+	uint64_t bytes;
+};
+
+// Self profile of one process or of the whole run
+struct profile{
+	uint64_t ns;
+	struct profphase phase[PROF_COUNT];
+};
+
+// Process in the slowest list of the self profile
+struct profproc{
+	uint64_t pid;
+	struct profile prof;
+};
+
+// Sections of a process, parsed in place from the whole maps text. PROCMAP_QUERY costs more
+// per section than the text so is only used to fetch the sections in an address range
+struct mapsreader{
+	int hfile;
+	bool query;
+	uint64_t start;
+	uint64_t end;
+	uint64_t next;
+	const char *text;
+	size_t textlen;
+	char *buf;
+	size_t size;
+	size_t len;
+	size_t pos;
+	bool loaded;
+	size_t last;
+	char perms[8];
+	char name[PATH_MAX + 32];
+};
 
 struct global{
 	int hkpagecount;
 	int hkpageflags;
+	int hpageidle;
 	
 	bool terminal;
 	int termwidth;
@@ -36,12 +397,270 @@ struct global{
 	bool verbose;
 	bool summary;
 	bool map;
-	bool writable;
+	uint64_t mapgran;
+	bool filter;
+	char perms[8];
+	bool namefilter;
+	regex_t nameregex;
+	uint64_t rangestart;
+	uint64_t rangeend;
 	bool list;
 	uint64_t pid;
 	uint64_t last_pid;
 	uint64_t tid;
 	bool threads;
+	int jobs;
+	bool pmscan;
+	bool mapquery;
+	pmdecode_t pmdecode;
+
+	int format;
+	char *outbuf;
+	size_t outlen;
+	int outcol;
+
+	const char *capture;
+	const char *replay;
+	struct snapshot *snap;
+	const char *diff;
+	struct snapshot *before;
+
+	int topkey;
+	uint64_t topn;
+
+	uint64_t eststride;
+
+	int xrefmode;
+	uint64_t xrefpfn;
+	uint64_t xrefpid;
+	uint64_t xrefaddr;
+	uint64_t xreftop;
+	int groupby;
+
+	bool physical;
+
+	bool profile;
+	uint64_t profstart;
+	struct profile prof;
+	struct profproc proftop[PROF_TOPN];
+	int nproftop;
+
+	bool numa;
+	int nodeids[MAX_NODES];
+	int nnodes;
+	struct noderange *noderanges;
+	uint64_t nnoderanges;
+	struct xref *xref;
+
+	uint64_t interval;
+	uint64_t count;
+	uint64_t iteration;
+	uint64_t idlewindow;
+
+	struct sample *prev;
+	uint64_t nprev;
+	uint64_t maxprev;
+	struct sample *cur;
+	uint64_t ncur;
+	uint64_t maxcur;
+
+	uint64_t bufentries;
+
+	uint64_t hugesizes[MAX_HUGESIZES];
+	int nhugesizes;
+
+	struct kcache *kcache;
+
+	uint64_t mapcell;
+	uint64_t mapfill;
+	uint64_t mappresent;
+	uint64_t mapswapped;
+	uint64_t mapboth;
+	size_t maplen;
+	char mapbuf[MAPBUF_SIZE];
+};
+
+// Run of pages in a process with consecutive virtual page numbers and PFNs
+struct xrefrun{
+	uint64_t pfn;
+	uint64_t vpn;
+	uint32_t pid;
+	uint32_t pages;
+};
+
+// Group of a process for -G, named when the process is scanned
+struct xrefproc{
+	uint32_t pid;
+	char group[MAX_GROUPNAME];
+};
+
+// Reverse PFN index, sorted into PFN order once all processes are scanned
+struct xref{
+	pthread_mutex_t lock;
+	struct xrefrun *runs;
+	uint64_t nruns;
+	uint64_t maxruns;
+	uint64_t maxpages;
+	struct xrefproc *procs;
+	uint64_t nprocs;
+	uint64_t maxprocs;
+	bool failed;
+};
+
+// Runs overlapping one PFN interval of the index
+struct xrefspan{
+	uint64_t pfn;
+	uint64_t pages;
+	struct xrefrun **active;
+	uint64_t nactive;
+};
+
+// End of a run when sweeping the index
+struct xrefend{
+	uint64_t pfn;
+	struct xrefrun *run;
+};
+
+// Group of pages mapped by the same set of processes
+struct xrefgroup{
+	uint64_t pages;
+	uint64_t mappings;
+	uint64_t npids;
+	uint32_t *pids;
+};
+
+// Sharing groups collected by the sweep
+struct xreftop{
+	struct xrefgroup *groups;
+	uint64_t ngroups;
+	uint64_t maxgroups;
+	uint32_t *pids;
+	bool failed;
+};
+
+// Pages of a section shared with another process
+struct xrefsharer{
+	uint32_t pid;
+	uint64_t pages;
+};
+
+// Process and the group it is accounted to
+struct xrefmember{
+	uint32_t pid;
+	uint32_t group;
+};
+
+// Memory accounted to a group of processes
+struct xrefacct{
+	char name[MAX_GROUPNAME];
+	uint64_t procs;
+	uint64_t resident;
+	uint64_t unique;
+	double proportional;
+};
+
+// Group accounting collected by the sweep
+struct xrefgroups{
+	struct xrefmember *members;
+	uint64_t nmembers;
+	struct xrefacct *accts;
+	uint64_t naccts;
+	uint32_t *mappings;
+	uint32_t *touched;
+};
+
+// PFN range of a memory zone
+struct physzone{
+	int node;
+	char name[16];
+	uint64_t start;
+	uint64_t end;
+	uint64_t free;
+};
+
+// Page counts for a zone
+struct physzonestats{
+	uint64_t present;
+	uint64_t anon;
+	uint64_t file;
+	uint64_t slab;
+	uint64_t mapped;
+};
+
+// Page counts for all physical memory
+struct physstats{
+	uint64_t scanned;
+	uint64_t present;
+	uint64_t mapped;
+	uint64_t flags[64];
+	struct physzonestats zones[MAX_ZONES];
+};
+
+// Range of PFNs scanned by one thread
+struct physjob{
+	struct global *globals;
+	struct physzone *zones;
+	int nzones;
+	uint64_t start;
+	uint64_t end;
+	struct physstats stats;
+	int result;
+};
+
+struct hugeunit{
+	uint64_t addr;
+	uint64_t pages;
+	uint64_t pfn;
+	uint64_t count;
+	uint64_t flags;
+	uint8_t got;
+};
+
+struct scanctx{
+	uint64_t pid;
+	uint64_t tid;
+
+	int hpagemap;
+	struct mapsreader maps;
+	uint64_t opentid;
+
+	uint64_t *pmbuf;
+	struct page_region *pmregions;
+
+	struct kpagereq *kpreq;
+	uint64_t *kprun;
+	uint64_t *kpcount;
+	uint64_t *kpflags;
+	uint8_t *kpgot;
+	uint64_t *kpidle;
+	uint64_t *diffbuf;
+
+	struct hugeunit hunit;
+
+	struct xrefrun *xrefbuf;
+	uint64_t nxref;
+
+	uint64_t nodehint;
+
+	uint64_t *pmdata;
+	uint64_t ndata;
+	struct pmcounts pmcounts;
+
+	struct profile *prof;
+
+	unsigned int estseed;
+};
+
+struct kcachechunk{
+	uint64_t valid[KCACHE_CHUNK / 64];
+	uint32_t count[KCACHE_CHUNK];
+	uint64_t flags[KCACHE_CHUNK];
+};
+
+struct kcache{
+	pthread_mutex_t lock;
+	uint64_t nchunks;
+	struct kcachechunk **chunks;
 };
 
 struct sstats{
@@ -53,27 +672,283 @@ struct sstats{
 	uint64_t refd;
 	uint64_t swapped;
 	uint64_t huge;
+	uint64_t accessed;
+	uint64_t node[MAX_NODES];
+
+	// Variance of sampled figures in bytes squared
+	bool estimated;
+	double var[EST_FIELDS];
+};
+
+// PFN range of memory blocks on one NUMA node
+struct noderange{
+	uint64_t start;
+	uint64_t end;
+	int node;
+};
+
+struct dstats{
+	uint64_t added;
+	uint64_t dropped;
+	uint64_t swapout;
+	uint64_t swapin;
+	uint64_t moved;
+	uint64_t reshared;
+};
+
+struct vmainfo{
+	uint64_t start;
+	uint64_t end;
+	char *perms;
+	const char *name;
+};
+
+struct sample{
+	uint64_t key[2];
+	struct sstats stats;
+};
+
+struct scanstate{
+	bool incompound;
+	bool hdgotpagecnt;
+	uint64_t hdpagecnt;
+	uint64_t hdpageflags;
+};
+
+struct shard{
+	uint64_t start;
+	uint64_t end;
+	struct sstats stats;
+	struct scanstate state;
+	bool resolved;
+
+	struct sstats leadown;
+	struct scanstate leadstate;
+	uint64_t leadpages;
+	uint64_t leadcnt;
+};
+
+struct shardpool{
+	struct global *globals;
+	int hpagemap;
+	bool pmscan;
+	struct shard *shards;
+	int nshards;
+	int nextshard;
+	struct profile *prof;
+	pthread_mutex_t lock;
+};
+
+struct listrow{
+	uint64_t tid;
+	struct sstats stats;
+	char *cmdline;
+};
+
+struct listjob{
+	uint64_t pid;
+	int attempts;
+	int nrows;
+	struct listrow *rows;
+	struct profile prof;
+	bool done;
+};
+
+struct listpool{
+	struct global *globals;
+	struct listjob *jobs;
+	int njobs;
+	int nextjob;
+	int procwidth;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t jobdone;
+};
+
+struct kpagereq{
+	uint64_t pfn;
+	uint64_t idx;
+};
+
+// Process ranked by an upper bound from its memory counters before scanning for -k
+struct topcand{
+	uint64_t pid;
+	uint64_t bound;
+};
+
+// Ranked processes scanned in parallel for -k, the largest kept in a min heap
+struct toppool{
+	struct global *globals;
+	struct topcand *cands;
+	int ncands;
+	int nextcand;
+	struct listjob *heap;
+	int nheap;
+	int maxheap;
+	int procwidth;
+	pthread_mutex_t lock;
 };
 
 int parse_args(struct global *globals, int argc, char **argv);
 bool parse_pid(struct global *globals, char *string);
+bool parse_num(char *string, uint64_t *value);
 void initialise(struct global *globals);
 void cleanup(struct global *globals);
+struct scanctx *scanctx_create(struct global *globals);
+void scanctx_destroy(struct scanctx *ctx);
 void usage();
 void printsize(uint64_t size);
 void dumpflags(uint64_t flags);
-void flushnp(struct global *globals, uint64_t *npstart, uint64_t offset, bool skip);
-int dumppid(struct global *globals);
-int dumpall(struct global *globals);
-void dumpall_pid(struct global *globals, uint64_t pid, uint64_t tid, int *printed, bool *needhdg, int procwidth);
-int dumpall_pid_threads(struct global *globals, uint64_t pid, int *printed, bool *needhdg, int procwidth);
+void flushnp(struct global *globals, uint64_t *npstart, uint64_t offset);
+void mapstart(struct global *globals, uint64_t pages);
+void mappages(struct global *globals, char ch, uint64_t count);
+void mapcellend(struct global *globals);
+void mapemit(struct global *globals, char ch, uint64_t count);
+void mapend(struct global *globals);
+void lookupkpages(struct global *globals, struct scanctx *ctx, uint64_t entries, uint64_t start, int huge);
+bool hugerun(struct global *globals, struct scanctx *ctx, uint64_t idx, uint64_t entries, uint64_t addr);
+bool hugepage(struct global *globals, struct scanctx *ctx, uint64_t addr, uint64_t pfn, bool probe);
+bool hugeprobe(struct global *globals, struct scanctx *ctx, uint64_t addr, uint64_t pfn, uint64_t pages);
+void hugesizes_probe(struct global *globals);
+uint64_t kpagerun(struct global *globals, struct scanctx *ctx, uint64_t first, uint64_t nreq);
+void readkpages(struct global *globals, struct scanctx *ctx, int kind, uint64_t pfn, uint64_t count, uint64_t *buf, uint64_t *got);
+ssize_t readpagemap(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t *buf, uint64_t entries, uint64_t page);
+int snap_capture(struct global *globals, struct scanctx *ctx);
+bool snap_addkp(struct snapkp **kps, uint64_t *nkps, uint64_t *maxkps, uint64_t pfn, uint64_t count, uint64_t flags);
+uint64_t snap_mergekps(struct snapkp *kps, uint64_t nkps);
+uint64_t snap_step(uint64_t entry);
+int snap_open(const char *path, struct snapshot **snapp);
+void snap_close(struct snapshot *snap);
+uint64_t snap_readpagemap(struct snapshot *snap, uint64_t *buf, uint64_t entries, uint64_t page);
+uint64_t snap_unreadable(struct snapshot *snap, uint64_t page);
+void snap_readkpages(struct snapshot *snap, bool counts, uint64_t pfn, uint64_t count, uint64_t *buf);
+int markidle(struct global *globals, struct scanctx *ctx);
+struct kcache *kcache_create();
+void kcache_destroy(struct kcache *cache);
+bool kcache_get(struct kcache *cache, uint64_t pfn, uint64_t *count, uint64_t *flags);
+void kcache_put(struct kcache *cache, uint64_t pfn, uint64_t count, uint64_t flags);
+int dumppid(struct global *globals, struct scanctx *ctx, struct sstats *totals);
+int dumpdiff(struct global *globals, struct scanctx *ctx);
+void diffpage(struct global *globals, struct scanctx *ctx, uint64_t idx, uint64_t offset, struct dstats *stats);
+void dumpdiffstats(struct dstats *stats);
+void diffunmapped(struct global *globals, struct scanctx *ctx, struct dstats *totals);
+void diffdropped(struct global *globals, struct scanctx *ctx, uint64_t start, uint64_t end, struct dstats *stats);
+void scanrange(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+               bool pmscan, struct scanstate *state, struct sstats *stats, struct shard *shard);
+uint64_t scanregions(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+                     struct scanstate *state, struct sstats *stats, struct shard *shard, uint64_t *npstart);
+uint64_t scanentries(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+                     int huge, struct scanstate *state, struct sstats *stats, struct shard *shard, uint64_t *npstart);
+void scanholes(struct global *globals, uint64_t start, uint64_t end, uint64_t *npstart);
+int scanshards(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+               bool pmscan, struct scanstate *state, struct sstats *stats);
+void scanestimate(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+                  bool pmscan, struct scanstate *state, struct sstats *stats);
+bool pmscan_probe();
+pmdecode_t pmdecode_probe();
+uint64_t pmdecode_scalar(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts);
+uint64_t pmdecode_sse2(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts);
+uint64_t pmdecode_avx2(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts);
+void decodeentries(struct global *globals, struct scanctx *ctx, uint64_t entries);
+bool pmscan_skipped(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start);
+void *scanshards_worker(void *arg);
+void scanshards_run(struct shardpool *pool, struct scanctx *ctx);
+void mergeshard(struct shard *shard, struct scanstate *state, struct sstats *stats);
+int dumpall(struct global *globals, struct scanctx *ctx);
+int dumpall_parallel(struct global *globals, struct scanctx *ctx, struct listjob *jobs, int njobs, int procwidth, int *printed,
+                     bool *needhdg);
+int dumpall_top(struct global *globals, struct scanctx *ctx, struct listjob *jobs, int njobs, int procwidth, int *printed,
+                bool *needhdg);
+void *top_worker(void *arg);
+void top_run(struct toppool *pool, struct scanctx *ctx);
+bool top_bound(struct global *globals, struct mapsreader *maps, uint64_t pid, uint64_t cpuslack, uint64_t *bound);
+uint64_t top_uncounted(struct mapsreader *maps, uint64_t pid);
+uint64_t top_value(struct global *globals, struct listjob *job);
+void top_siftup(struct global *globals, struct listjob *heap, int idx);
+void top_siftdown(struct global *globals, struct listjob *heap, int nheap, int idx);
+void top_drop(struct global *globals, struct listjob *job);
+void *dumpall_worker(void *arg);
+int dumpall_job(struct global *globals, struct scanctx *ctx, struct listjob *job, int procwidth);
+bool dumpall_addrow(struct global *globals, struct scanctx *ctx, struct listjob *job, uint64_t tid, int procwidth,
+                    struct sstats *stats, bool scan);
+void dumpall_print(struct global *globals, struct listjob *job, int *printed, bool *needhdg);
+void dumpall_heading(struct global *globals);
 void dumpstats(struct global *globals, struct sstats *stats);
+void dumperror(struct sstats *stats, int field);
+void dumpdelta(struct global *globals, struct sstats *stats, uint64_t key0, uint64_t key1);
+void dumprecord(struct global *globals, int rectype, uint64_t pid, uint64_t tid, struct vmainfo *vma,
+                struct sstats *stats, const char *cmdline);
+void dumppage(struct global *globals, struct scanctx *ctx, uint64_t idx, uint64_t offset);
+void out_header(struct global *globals);
+void out_begin(struct global *globals, int rectype);
+void out_num(struct global *globals, int field, uint64_t value);
+void out_text(struct global *globals, int field, const char *value);
+void out_field(struct global *globals, int field);
+void out_end(struct global *globals);
+void out_write(struct global *globals, const void *data, size_t len);
+void out_flush(struct global *globals);
+void sample_add(struct global *globals, uint64_t key0, uint64_t key1, struct sstats *stats);
+struct sample *sample_find(struct global *globals, uint64_t key0, uint64_t key1);
+void sample_next(struct global *globals);
+int scanctx_open(struct global *globals, struct scanctx *ctx);
+bool maps_open(struct mapsreader *maps, const char *path, bool query, uint64_t start, uint64_t end);
+void maps_openmem(struct mapsreader *maps, const char *text, size_t textlen);
+void maps_rewind(struct mapsreader *maps);
+void maps_close(struct mapsreader *maps);
+void maps_free(struct mapsreader *maps);
+bool maps_load(struct mapsreader *maps);
+uint64_t maps_hex(char *text, char **end);
+bool maps_parse(struct mapsreader *maps, struct vmainfo *vma);
+bool maps_query(struct mapsreader *maps, struct vmainfo *vma);
+bool maps_next(struct mapsreader *maps, struct vmainfo *vma, struct profile *prof);
+bool mapquery_probe();
+void scanctx_close(struct scanctx *ctx);
+void waitinterval(struct global *globals, struct timespec *next);
+void addstats(struct sstats *stats, struct sstats *add);
+void addscaled(struct sstats *stats, struct sstats *add, double scale);
+void clearstate(struct scanstate *state);
 void clearstats(struct sstats *stats);
-void printcmdline(uint64_t pid, int width);
+char *getcmdline(uint64_t pid, int width);
+bool parse_xref(struct global *globals, char *string);
+bool parse_top(struct global *globals, char *string);
+bool parse_estimate(struct global *globals, char *string);
+bool parse_range(struct global *globals, char *string);
+bool vma_filter(struct global *globals, struct vmainfo *vma);
+struct xref *xref_create();
+void xref_destroy(struct xref *xref);
+void xref_add(struct global *globals, struct scanctx *ctx, uint64_t pfn, uint64_t addr);
+void xref_flush(struct global *globals, struct scanctx *ctx);
+void xref_addgroup(struct global *globals, uint32_t pid);
+uint64_t xref_first(struct xref *xref, uint64_t pfn);
+bool xref_sweep(struct xref *xref, void (*visit)(struct xrefspan *span, void *arg), void *arg);
+int xref_report(struct global *globals);
+int xref_top(struct global *globals);
+int xref_pfn(struct global *globals);
+int xref_vma(struct global *globals);
+bool group_name(struct global *globals, uint32_t pid, char *name);
+bool xref_groupmembers(struct global *globals, struct xrefgroups *groups);
+int xref_groups(struct global *globals);
+int nodes_load(struct global *globals);
+int physscan(struct global *globals);
+uint64_t physscan_maxpfn(struct global *globals);
+int physscan_zones(struct physzone *zones);
+void *physscan_worker(void *arg);
+bool physzone_holds(struct physzone *zone, uint64_t pfn, int node);
+void physscan_print(struct physstats *stats, struct physzone *zones, int nzones);
+int pfn_node(struct global *globals, struct scanctx *ctx, uint64_t pfn);
+uint64_t prof_now();
+uint64_t prof_start(struct profile *prof);
+uint64_t prof_end(struct profile *prof, int phase, uint64_t start, uint64_t bytes);
+void prof_merge(struct profile *into, struct profile *from);
+void prof_record(struct global *globals, uint64_t pid, struct profile *prof);
+void prof_report(struct global *globals);
 
 int main(int argc, char **argv)
 {
 	struct global globals;
+	struct scanctx *ctx;
+	struct timespec next;
+	uint64_t profstart;
 	int result;
 
 	// Initialise globals
@@ -87,14 +962,157 @@ int main(int argc, char **argv)
 		return result;
 	}
 
-	// Main process
-	if (globals.pid && !globals.threads) {
-		result = dumppid(&globals);
-	} else {
-		result = dumpall(&globals);
+	if (globals.idlewindow != 0) {
+		// Open the idle page bitmap for writing
+		globals.hpageidle = open(PAGE_IDLE_BITMAP, O_RDWR);
+
+		if (globals.hpageidle < 0) {
+			fprintf(stderr, "Error opening " PAGE_IDLE_BITMAP ": ");
+			perror(NULL);
+			cleanup(&globals);
+			return RET_IDLE;
+		}
+	}
+
+	if (globals.numa) {
+		// Map PFN ranges to NUMA nodes
+		result = nodes_load(&globals);
+
+		if (result != RET_OK) {
+			cleanup(&globals);
+			return result;
+		}
+	}
+
+	if (globals.replay != NULL) {
+		// Report from a snapshot instead of /proc
+		result = snap_open(globals.replay, &globals.snap);
+
+		if (result != RET_OK) {
+			cleanup(&globals);
+			return result;
+		}
+
+		globals.pid = globals.snap->hdr->pid;
+		globals.tid = globals.snap->hdr->tid;
+		globals.pmscan = false;
+
+		// Kernel page details come from the snapshot
+		if (globals.hkpagecount >= 0) close(globals.hkpagecount);
+		if (globals.hkpageflags >= 0) close(globals.hkpageflags);
+		globals.hkpagecount = (globals.snap->hdr->flags & SNAP_KPAGECOUNT) ? dup(globals.snap->hfile) : -1;
+		globals.hkpageflags = (globals.snap->hdr->flags & SNAP_KPAGEFLAGS) ? dup(globals.snap->hfile) : -1;
+	}
+
+	if (globals.diff != NULL) {
+		// Snapshot to compare against
+		result = snap_open(globals.diff, &globals.before);
+
+		if (result != RET_OK) {
+			cleanup(&globals);
+			return result;
+		}
+
+		if (globals.before->hdr->pid != globals.pid) {
+			fprintf(stderr, "Error: Snapshot %s is of process %" PRIu64 ", not %" PRIu64 "\n", globals.diff,
+			        globals.before->hdr->pid, globals.pid);
+			cleanup(&globals);
+			return RET_SNAPSHOT;
+		}
+	}
+
+	if (globals.format != OUT_TEXT) {
+		// Allocate structured output buffer
+		globals.outbuf = (char *) malloc(OUTBUF_SIZE);
+
+		if (globals.outbuf == NULL) {
+			fprintf(stderr, "Error: Unable to allocate output buffer\n");
+			cleanup(&globals);
+			return RET_NOMEM;
+		}
+
+		out_header(&globals);
+	}
+
+	// Allocate scan buffers
+	ctx = scanctx_create(&globals);
+
+	if (ctx == NULL) {
+		fprintf(stderr, "Error: Unable to allocate scan buffers\n");
+		cleanup(&globals);
+		return RET_NOMEM;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (globals.iteration = 0; ; globals.iteration++) {
+		// Time the scan for the self profile
+		if (ctx->prof != NULL) memset(ctx->prof, 0, sizeof(struct profile));
+		profstart = prof_now();
+
+		// Main process
+		if (globals.physical) {
+			result = physscan(&globals);
+		} else if (globals.capture != NULL) {
+			ctx->pid = globals.pid;
+			ctx->tid = globals.tid;
+			result = snap_capture(&globals, ctx);
+		} else if (globals.diff != NULL) {
+			ctx->pid = globals.pid;
+			ctx->tid = globals.tid;
+			result = dumpdiff(&globals, ctx);
+		} else if (globals.pid && !globals.threads) {
+			ctx->pid = globals.pid;
+			ctx->tid = globals.tid;
+
+			if (globals.idlewindow != 0) {
+				// Mark pages idle and give the process time to touch them
+				result = markidle(&globals, ctx);
+				if (result != RET_OK) break;
+
+				fflush(stdout);
+				out_flush(&globals);
+				sleep(globals.idlewindow);
+
+				// The idle window isn't part of the profile
+				profstart = prof_now();
+			}
+
+			result = dumppid(&globals, ctx, NULL);
+		} else {
+			result = dumpall(&globals, ctx);
+		}
+
+		if (globals.profile) {
+			globals.prof.ns += prof_now() - profstart;
+
+			// Processes listed are profiled as they are printed
+			if (!globals.list && ctx->prof != NULL) {
+				ctx->prof->ns = prof_now() - profstart;
+				prof_record(&globals, globals.pid, ctx->prof);
+			}
+		}
+
+		if (globals.interval == 0 || result != RET_OK) break;
+		if (globals.count != 0 && globals.iteration + 1 >= globals.count) break;
+
+		// Keep this iteration for the next delta and wait for the next interval
+		sample_next(&globals);
+		fflush(stdout);
+		out_flush(&globals);
+		waitinterval(&globals, &next);
+	}
+
+	// Clean up scan buffers and globals
+	scanctx_destroy(ctx);
+
+	out_flush(&globals);
+
+	if (globals.profile) {
+		fflush(stdout);
+		prof_report(&globals);
 	}
 
-	// Clean up globals
 	cleanup(&globals);
 	
 	return result;
@@ -103,9 +1121,13 @@ int main(int argc, char **argv)
 int parse_args(struct global *globals, int argc, char **argv)
 {
 	int opt;
+	uint64_t num;
+	int result;
+	char errbuf[256];
+	const char *perm;
 
 	// Parse arguments
-	while ((opt = getopt(argc, argv, ":hvmswp:t:")) != -1){
+	while ((opt = getopt(argc, argv, ":hvmswNSTp:t:b:j:i:n:a:o:g:c:r:d:x:G:P:R:A:k:e:")) != -1){
 		switch (opt) {
 		case 'h':
 			return RET_HELP;
@@ -118,12 +1140,73 @@ int parse_args(struct global *globals, int argc, char **argv)
 			globals->map = true;
 			break;
 
+		case 'g':
+			if (!parse_num(optarg, &globals->mapgran) || globals->mapgran == 0) {
+				fprintf(stderr, "Error: Invalid map granularity '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
 		case 's':
 			globals->summary = true;
 			break;
 
 		case 'w':
-			globals->writable = true;
+			// Same as -P w
+			if (strchr(globals->perms, 'w') == NULL) strcat(globals->perms, "w");
+			globals->filter = true;
+			break;
+
+		case 'P':
+			if (strlen(optarg) > 5 || strspn(optarg, "rwxsp") != strlen(optarg)) {
+				fprintf(stderr, "Error: Invalid permissions '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			// Added to the permissions already required, as -w does
+			for (perm = optarg; *perm != '\x0'; perm++) {
+				if (strchr(globals->perms, *perm) == NULL) strncat(globals->perms, perm, 1);
+			}
+
+			globals->filter = true;
+			break;
+
+		case 'R':
+			if (globals->namefilter) regfree(&globals->nameregex);
+			globals->namefilter = false;
+
+			result = regcomp(&globals->nameregex, optarg, REG_EXTENDED | REG_NOSUB);
+
+			if (result != 0) {
+				regerror(result, &globals->nameregex, errbuf, sizeof(errbuf));
+				fprintf(stderr, "Error: Invalid section name pattern '%s': %s\n", optarg, errbuf);
+				return RET_BADARG;
+			}
+
+			globals->namefilter = true;
+			globals->filter = true;
+			break;
+
+		case 'A':
+			if (!parse_range(globals, optarg)) {
+				fprintf(stderr, "Error: Invalid address range '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			globals->filter = true;
+			break;
+
+		case 'N':
+			globals->numa = true;
+			break;
+
+		case 'S':
+			globals->physical = true;
+			break;
+
+		case 'T':
+			globals->profile = true;
 			break;
 
 		case 'p':
@@ -154,6 +1237,106 @@ int parse_args(struct global *globals, int argc, char **argv)
 
 			break;
 
+		case 'b':
+			if (!parse_num(optarg, &globals->bufentries) || globals->bufentries == 0 || globals->bufentries > MAX_BUFENTRIES) {
+				fprintf(stderr, "Error: Invalid buffer size '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
+		case 'j':
+			if (!parse_num(optarg, &num) || num == 0 || num > 1024) {
+				fprintf(stderr, "Error: Invalid number of jobs '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			globals->jobs = (int) num;
+			break;
+
+		case 'i':
+			if (!parse_num(optarg, &globals->interval) || globals->interval == 0) {
+				fprintf(stderr, "Error: Invalid interval '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
+		case 'n':
+			if (!parse_num(optarg, &globals->count) || globals->count == 0) {
+				fprintf(stderr, "Error: Invalid count '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
+		case 'a':
+			if (!parse_num(optarg, &globals->idlewindow) || globals->idlewindow == 0 || globals->idlewindow > UINT_MAX) {
+				fprintf(stderr, "Error: Invalid idle window '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
+		case 'c':
+			globals->capture = optarg;
+			break;
+
+		case 'r':
+			globals->replay = optarg;
+			break;
+
+		case 'd':
+			globals->diff = optarg;
+			break;
+
+		case 'x':
+			if (!parse_xref(globals, optarg)) {
+				fprintf(stderr, "Error: Invalid index query '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
+		case 'k':
+			if (!parse_top(globals, optarg)) {
+				fprintf(stderr, "Error: Invalid ranking '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
+		case 'e':
+			if (!parse_estimate(globals, optarg)) {
+				fprintf(stderr, "Error: Invalid sample percentage '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
+		case 'G':
+			if (strcmp(optarg, "uid") == 0) globals->groupby = GROUP_UID;
+			else if (strcmp(optarg, "cgroup") == 0) globals->groupby = GROUP_CGROUP;
+			else if (strcmp(optarg, "tree") == 0) globals->groupby = GROUP_TREE;
+			else {
+				fprintf(stderr, "Error: Invalid grouping '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
+		case 'o':
+			if (strcmp(optarg, "text") == 0) globals->format = OUT_TEXT;
+			else if (strcmp(optarg, "json") == 0) globals->format = OUT_JSON;
+			else if (strcmp(optarg, "csv") == 0) globals->format = OUT_CSV;
+			else if (strcmp(optarg, "bin") == 0) globals->format = OUT_BIN;
+			else {
+				fprintf(stderr, "Error: Invalid output format '%s'\n", optarg);
+				return RET_BADARG;
+			}
+
+			break;
+
 		case ':':
 			switch (optopt) {
 			case 't':
@@ -180,8 +1363,8 @@ int parse_args(struct global *globals, int argc, char **argv)
 		return RET_BADARG;
 	}
 
-	if (globals->verbose || globals->map || globals->summary || globals->writable) {
-		if (globals->pid == 0 || globals->threads) {
+	if (globals->verbose || globals->map || globals->summary || globals->idlewindow) {
+		if ((globals->pid == 0 && globals->replay == NULL) || globals->threads) {
 			fprintf(stderr, "Error: Options require a single PID specified with -p only\n");
 			return RET_BADARGCOMB;
 		}
@@ -192,11 +1375,113 @@ int parse_args(struct global *globals, int argc, char **argv)
 		return RET_BADARGCOMB;
 	}
 
-	return RET_OK;
-}
+	if (globals->interval != 0 && (globals->verbose || globals->map)) {
+		fprintf(stderr, "Error: -i can't be used with -v or -m\n");
+		return RET_BADARGCOMB;
+	}
 
-bool parse_pid(struct global *globals, char *string)
-{
+	if (globals->mapgran != 0 && !globals->map) {
+		fprintf(stderr, "Error: -g requires -m\n");
+		return RET_BADARGCOMB;
+	}
+
+	if (globals->map && globals->format != OUT_TEXT) {
+		fprintf(stderr, "Error: -m can only be used with text output\n");
+		return RET_BADARGCOMB;
+	}
+
+	if (globals->interval != 0 && globals->idlewindow != 0) {
+		fprintf(stderr, "Error: -i can't be used with -a\n");
+		return RET_BADARGCOMB;
+	}
+
+	if (globals->capture != NULL) {
+		if (globals->pid == 0 || globals->threads) {
+			fprintf(stderr, "Error: -c requires a single PID specified with -p\n");
+			return RET_BADARGCOMB;
+		}
+
+		if (globals->verbose || globals->map || globals->summary || globals->interval || globals->idlewindow ||
+		    globals->replay != NULL || globals->format != OUT_TEXT) {
+			fprintf(stderr, "Error: -c can't be used with reporting options\n");
+			return RET_BADARGCOMB;
+		}
+
+		// Snapshots hold the whole process, filters apply when replaying
+		if (globals->filter) {
+			fprintf(stderr, "Error: -c can't be used with -P, -R, -A or -w, filter the snapshot with -r instead\n");
+			return RET_BADARGCOMB;
+		}
+	}
+
+	if (globals->replay != NULL) {
+		if (globals->pid != 0 || globals->threads || globals->interval || globals->idlewindow) {
+			fprintf(stderr, "Error: -r can't be used with -p, -t, -i or -a\n");
+			return RET_BADARGCOMB;
+		}
+	}
+
+	if (globals->diff != NULL) {
+		if ((globals->pid == 0 && globals->replay == NULL) || globals->threads) {
+			fprintf(stderr, "Error: -d requires a single PID specified with -p, or -r\n");
+			return RET_BADARGCOMB;
+		}
+
+		if (globals->map || globals->interval || globals->idlewindow || globals->capture != NULL || globals->format != OUT_TEXT) {
+			fprintf(stderr, "Error: -d can't be used with -m, -i, -a, -c or -o\n");
+			return RET_BADARGCOMB;
+		}
+	}
+
+	if (globals->xrefmode != 0 || globals->groupby != 0) {
+		if (globals->pid != 0 || globals->threads || globals->interval || globals->format != OUT_TEXT || globals->replay != NULL ||
+		    globals->capture != NULL) {
+			fprintf(stderr, "Error: -x and -G can only be used when listing all processes\n");
+			return RET_BADARGCOMB;
+		}
+	}
+
+	if (globals->topkey != 0) {
+		if (globals->pid != 0 || globals->threads || globals->replay != NULL || globals->capture != NULL ||
+		    globals->xrefmode != 0 || globals->groupby != 0) {
+			fprintf(stderr, "Error: -k can only be used when listing all processes\n");
+			return RET_BADARGCOMB;
+		}
+
+		if ((globals->topkey == TOP_PRIVATE && globals->hkpagecount < 0) ||
+		    ((globals->topkey == TOP_ANON || globals->topkey == TOP_HUGE) && globals->hkpageflags < 0)) {
+			fprintf(stderr, "Error: -k ranking needs kernel page details (root only)\n");
+			return RET_BADARGCOMB;
+		}
+	}
+
+	if (globals->eststride != 0) {
+		if (globals->verbose || globals->map || globals->interval || globals->capture != NULL || globals->diff != NULL ||
+		    globals->xrefmode != 0 || globals->groupby != 0 || globals->format != OUT_TEXT) {
+			fprintf(stderr, "Error: -e can't be used with -v, -m, -i, -c, -d, -x, -G or -o\n");
+			return RET_BADARGCOMB;
+		}
+	}
+
+	if (globals->physical) {
+		if (globals->pid != 0 || globals->threads || globals->format != OUT_TEXT || globals->replay != NULL ||
+		    globals->capture != NULL || globals->diff != NULL || globals->xrefmode != 0 || globals->groupby != 0 ||
+		    globals->filter || globals->numa || globals->idlewindow || globals->topkey != 0 || globals->eststride != 0) {
+			fprintf(stderr, "Error: -S can't be used with process options\n");
+			return RET_BADARGCOMB;
+		}
+	}
+
+	if (globals->count != 0 && globals->interval == 0) {
+		fprintf(stderr, "Error: -n requires -i\n");
+		return RET_BADARGCOMB;
+	}
+
+	return RET_OK;
+}
+
+bool parse_pid(struct global *globals, char *string)
+{
 	if (strcmp(string, "self") == 0) {
 		// Use current pid
 		globals->pid = getpid();
@@ -219,9 +1504,129 @@ bool parse_pid(struct global *globals, char *string)
 	return true;
 }
 
+bool parse_xref(struct global *globals, char *string)
+{
+	char *end;
+
+	errno = 0;
+
+	if (strcmp(string, "top") == 0) {
+		// Largest groups of shared pages
+		globals->xrefmode = XREF_TOP;
+		globals->xreftop = XREF_TOPN;
+
+	} else if (strncmp(string, "top:", 4) == 0) {
+		globals->xrefmode = XREF_TOP;
+		if (!parse_num(string + 4, &globals->xreftop) || globals->xreftop == 0) return false;
+
+	} else if (strncmp(string, "pfn:", 4) == 0) {
+		// Mappers of one PFN
+		globals->xrefmode = XREF_PFN;
+		globals->xrefpfn = strtoull(string + 4, &end, 16);
+		if (errno != 0 || end == string + 4 || *end != '\x0') return false;
+
+	} else if (strncmp(string, "vma:", 4) == 0) {
+		// Sharers of a process section
+		globals->xrefmode = XREF_VMA;
+		globals->xrefpid = strtoull(string + 4, &end, 10);
+		if (errno != 0 || end == string + 4 || *end != ':') return false;
+
+		string = end + 1;
+		globals->xrefaddr = strtoull(string, &end, 16);
+		if (errno != 0 || end == string || *end != '\x0') return false;
+
+	} else {
+		return false;
+
+	}
+
+	return true;
+}
+
+bool parse_top(struct global *globals, char *string)
+{
+	const char *keys[] = { "present", "private", "swapped", "anon", "huge" };
+	char *num;
+	size_t keylen;
+	int key;
+
+	num = strchr(string, ':');
+	keylen = (num != NULL ? (size_t) (num - string) : strlen(string));
+
+	for (key = 0; key < 5; key++) {
+		if (strlen(keys[key]) == keylen && strncmp(string, keys[key], keylen) == 0) break;
+	}
+
+	if (key == 5) return false;
+
+	globals->topkey = TOP_PRESENT + key;
+	globals->topn = TOP_DEFAULT;
+
+	if (num != NULL && (!parse_num(num + 1, &globals->topn) || globals->topn == 0 || globals->topn > INT_MAX)) return false;
+
+	return true;
+}
+
+bool parse_estimate(struct global *globals, char *string)
+{
+	char *end;
+	double percent;
+
+	errno = 0;
+	percent = strtod(string, &end);
+	if (errno != 0 || end == string || *end != '\x0' || !(percent >= 0.01 && percent <= 100.0)) return false;
+
+	// Read one unit in each stratum of this many
+	globals->eststride = (uint64_t) (100.0 / percent + 0.5);
+	if (globals->eststride == 0) globals->eststride = 1;
+
+	return true;
+}
+
+bool parse_range(struct global *globals, char *string)
+{
+	char *end;
+	uint64_t pagesize = getpagesize();
+
+	errno = 0;
+
+	globals->rangestart = strtoull(string, &end, 16);
+	if (errno != 0 || end == string || *end != '-') return false;
+
+	string = end + 1;
+	globals->rangeend = strtoull(string, &end, 16);
+	if (errno != 0 || end == string || *end != '\x0') return false;
+
+	if (globals->rangeend <= globals->rangestart) return false;
+
+	// Whole pages covering the range
+	globals->rangestart -= globals->rangestart % pagesize;
+	if (globals->rangeend > UINT64_MAX - pagesize) globals->rangeend = UINT64_MAX;
+	else if (globals->rangeend % pagesize != 0) globals->rangeend += pagesize - globals->rangeend % pagesize;
+
+	return true;
+}
+
+bool parse_num(char *string, uint64_t *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtoull(string, &end, 10);
+
+	if (errno != 0 || end == string || *end != '\x0') {
+		return false;
+	}
+
+	return true;
+}
+
 void usage()
 {
-	printf("Usage: PageMap [-t [<pid>] | [-p <pid> [-v | -m] [-s] [-w]]]\n"
+	printf("Usage: PageMap [-t [<pid>] | [-p <pid> [-v | -m [-g <pages>]] [-s] [-w]]] [-b <num>] [-j <num>]\n"
+	       "               [-i <secs> [-n <count>] | -a <secs>] [-o <format>] [-c <file> | -r <file>]\n"
+	       "               [-d <file>] [-x <query>] [-G <by>] [-N] [-S] [-T] [-P <perms>] [-R <regex>]\n"
+	       "               [-A <range>] [-k <rank>] [-e <pct>]\n"
 	       "   where: -p <pid>    Process / thread ID to dump\n"
 	       "          -v          Dump each present / swapped page frame\n"
 	       "          -m          Dump status map of each mapped frame:\n"
@@ -229,10 +1634,65 @@ void usage()
 		   "                        'S' = swapped\n"
 		   "                        'B' = present and swapped\n"
 		   "                        '.' = not present\n"
+		   "                      Lower case letters mark cells of several pages that\n"
+		   "                      are only partly present or swapped\n"
+	       "          -g <pages>  Pages per map cell (default fits each section to the\n"
+	       "                      terminal width, or 1 when not a terminal)\n"
 	       "          -s          Print statistics for each mapped section\n"
 	       "          -w          Only process writable sections\n"
+	       "          -P <perms>  Only process sections with all of the permissions\n"
+	       "                      <perms> (any of r, w, x, s and p)\n"
+	       "          -R <regex>  Only process sections with names matching the\n"
+	       "                      extended regular expression <regex>\n"
+	       "          -A <range>  Only process the hex address range <start>-<end>\n"
+	       "                      Filtered sections are not read at all and are left\n"
+	       "                      out of the totals\n"
+	       "          -N          Break present memory down by NUMA node (needs page\n"
+	       "                      frame numbers, so root; up to 64 nodes with memory)\n"
+	       "          -S          Scan all physical memory instead of processes, giving\n"
+	       "                      page flag and per zone totals (root only)\n"
+	       "          -T          Profile the run, reporting time, calls and bytes read\n"
+	       "                      in each phase and the slowest processes on stderr\n"
 	       "          -t [<pid>]  Display all threads for each process\n"
-		   "          -h          Show this help\n");
+	       "          -k <rank>   Only list the largest processes. <rank> is <key>[:<num>]\n"
+	       "                      to list <num> processes (default %u) by <key>, one of\n"
+	       "                      present, private, swapped, anon or huge. Processes\n"
+	       "                      whose memory counters show they can't make the list\n"
+	       "                      aren't scanned\n"
+	       "          -e <pct>    Estimate totals from about <pct>%% of each section,\n"
+	       "                      read in 2MB units spread evenly across it, printing\n"
+	       "                      95%% confidence intervals\n"
+	       "          -b <num>    Page map entries to read per call (default %u)\n"
+	       "          -j <num>    Number of processes (or sections of a large process) to\n"
+	       "                      scan in parallel\n"
+	       "          -i <secs>   Rescan every <secs> seconds printing changes\n"
+	       "          -n <count>  Stop after <count> scans\n"
+	       "          -a <secs>   Mark present pages idle and report how much was accessed\n"
+	       "                      after <secs> seconds (working set)\n"
+	       "          -o <format> Output format, one of:\n"
+	       "                        text = readable tables (default)\n"
+	       "                        json = one JSON object per line\n"
+	       "                        csv  = comma separated values with a header\n"
+	       "                        bin  = compact binary records\n"
+	       "                      Structured formats report sizes in bytes and absolute\n"
+	       "                      values for each interval\n"
+	       "          -c <file>   Capture a snapshot of the process to <file>\n"
+	       "          -r <file>   Report from a snapshot captured with -c instead of the\n"
+	       "                      running process\n"
+	       "          -d <file>   Report pages that changed since the snapshot <file> was\n"
+	       "                      captured\n"
+	       "          -x <query>  Index physical pages of all processes and report:\n"
+	       "                        top[:<num>]         = largest groups of pages shared by\n"
+	       "                                              the same processes\n"
+	       "                        pfn:<pfn>           = processes mapping a page frame\n"
+	       "                        vma:<pid>:<address> = processes sharing pages with the\n"
+	       "                                              section of <pid> at <address>\n"
+	       "          -G <by>     Account memory unique to and shared by groups of\n"
+	       "                      processes, grouped by:\n"
+	       "                        uid    = owning user\n"
+	       "                        cgroup = control group\n"
+	       "                        tree   = top level process below init\n"
+		   "          -h          Show this help\n", TOP_DEFAULT, DEF_BUFENTRIES);
 }
 
 void initialise(struct global *globals)
@@ -242,13 +1702,66 @@ void initialise(struct global *globals)
 	globals->verbose = false;
 	globals->summary = false;
 	globals->map = false;
-	globals->writable = false;
+	globals->mapgran = 0;
+	globals->filter = false;
+	globals->perms[0] = '\x0';
+	globals->namefilter = false;
+	globals->rangestart = 0;
+	globals->rangeend = UINT64_MAX;
 	globals->list = false;
 	globals->pid = 0;
 	globals->last_pid = UINT64_MAX;
 	globals->tid = 0;
 	globals->threads = false;
+	globals->jobs = 1;
+	globals->format = OUT_TEXT;
+	globals->outbuf = NULL;
+	globals->outlen = 0;
+	globals->outcol = 0;
+	globals->capture = NULL;
+	globals->replay = NULL;
+	globals->snap = NULL;
+	globals->diff = NULL;
+	globals->before = NULL;
+	globals->topkey = 0;
+	globals->topn = 0;
+	globals->eststride = 0;
+	globals->xrefmode = 0;
+	globals->groupby = 0;
+	globals->physical = false;
+	globals->profile = false;
+	memset(&globals->prof, 0, sizeof(struct profile));
+	globals->nproftop = 0;
+	globals->numa = false;
+	globals->nnodes = 0;
+	globals->noderanges = NULL;
+	globals->nnoderanges = 0;
+	globals->xref = NULL;
+	globals->interval = 0;
+	globals->count = 0;
+	globals->iteration = 0;
+	globals->idlewindow = 0;
+	globals->hpageidle = -1;
+	globals->prev = NULL;
+	globals->nprev = 0;
+	globals->maxprev = 0;
+	globals->cur = NULL;
+	globals->ncur = 0;
+	globals->maxcur = 0;
+	globals->bufentries = DEF_BUFENTRIES;
+	globals->nhugesizes = 0;
+	globals->kcache = NULL;
 	
+	// Check for the PAGEMAP_SCAN ioctl
+	globals->pmscan = pmscan_probe();
+	globals->mapquery = mapquery_probe();
+
+	// Pick the fastest page map decoder for the CPU
+	globals->pmdecode = pmdecode_probe();
+
+	// Find transparent and hugetlb page sizes
+	hugesizes_probe(globals);
+
 	// Try and open kernel page stats
 	globals->hkpagecount = open("/proc/kpagecount", O_RDONLY);
 	globals->hkpageflags = open("/proc/kpageflags", O_RDONLY);
@@ -269,6 +1782,408 @@ void cleanup(struct global *globals)
 {
 	if (globals->hkpagecount >= 0) close(globals->hkpagecount);
 	if (globals->hkpageflags >= 0) close(globals->hkpageflags);
+	if (globals->hpageidle >= 0) close(globals->hpageidle);
+	if (globals->kcache != NULL) kcache_destroy(globals->kcache);
+	if (globals->prev != NULL) free(globals->prev);
+	if (globals->cur != NULL) free(globals->cur);
+	if (globals->outbuf != NULL) free(globals->outbuf);
+	if (globals->snap != NULL) snap_close(globals->snap);
+	if (globals->before != NULL) snap_close(globals->before);
+	if (globals->namefilter) regfree(&globals->nameregex);
+	if (globals->xref != NULL) xref_destroy(globals->xref);
+	if (globals->noderanges != NULL) free(globals->noderanges);
+}
+
+struct scanctx *scanctx_create(struct global *globals)
+{
+	struct scanctx *ctx;
+
+	if (globals->bufentries > SIZE_MAX / sizeof(struct kpagereq)) return NULL;
+
+	ctx = (struct scanctx *) calloc(1, sizeof(struct scanctx));
+	if (ctx == NULL) return NULL;
+
+	ctx->hpagemap = -1;
+	ctx->maps.hfile = -1;
+
+	// Units read by -e are picked differently by each context
+	ctx->estseed = (unsigned int) time(NULL) ^ (unsigned int) getpid() ^ (unsigned int) (uintptr_t) ctx;
+
+	// Page map entry and region buffers
+	ctx->pmbuf = (uint64_t *) malloc(globals->bufentries * sizeof(uint64_t));
+	ctx->pmdata = (uint64_t *) malloc(globals->bufentries * sizeof(uint64_t));
+	ctx->pmregions = (struct page_region *) malloc(PMSCAN_REGIONS * sizeof(struct page_region));
+
+	// Kernel page lookup buffers
+	ctx->kpreq = (struct kpagereq *) malloc(globals->bufentries * sizeof(struct kpagereq));
+	ctx->kprun = (uint64_t *) malloc(globals->bufentries * sizeof(uint64_t));
+	ctx->kpcount = (uint64_t *) malloc(globals->bufentries * sizeof(uint64_t));
+	ctx->kpflags = (uint64_t *) malloc(globals->bufentries * sizeof(uint64_t));
+	ctx->kpgot = (uint8_t *) malloc(globals->bufentries);
+
+	// Idle bitmap words covering one run of PFNs
+	ctx->kpidle = (uint64_t *) malloc((globals->bufentries / 64 + 2) * sizeof(uint64_t));
+
+	// Reverse PFN index runs waiting to be added
+	if (globals->xrefmode != 0 || globals->groupby != 0) {
+		ctx->xrefbuf = (struct xrefrun *) malloc(XREF_BATCH * sizeof(struct xrefrun));
+
+		if (ctx->xrefbuf == NULL) {
+			scanctx_destroy(ctx);
+			return NULL;
+		}
+	}
+
+	// Self profile counters
+	if (globals->profile) {
+		ctx->prof = (struct profile *) calloc(1, sizeof(struct profile));
+
+		if (ctx->prof == NULL) {
+			scanctx_destroy(ctx);
+			return NULL;
+		}
+	}
+
+	// Earlier page map entries when comparing with a snapshot
+	if (globals->diff != NULL) {
+		ctx->diffbuf = (uint64_t *) malloc(globals->bufentries * sizeof(uint64_t));
+
+		if (ctx->diffbuf == NULL) {
+			scanctx_destroy(ctx);
+			return NULL;
+		}
+	}
+
+	if (ctx->pmbuf == NULL || ctx->pmdata == NULL || ctx->pmregions == NULL || ctx->kpreq == NULL || ctx->kprun == NULL ||
+	    ctx->kpcount == NULL || ctx->kpflags == NULL || ctx->kpgot == NULL || ctx->kpidle == NULL) {
+		scanctx_destroy(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+bool maps_open(struct mapsreader *maps, const char *path, bool query, uint64_t start, uint64_t end)
+{
+	maps->hfile = open(path, O_RDONLY);
+	if (maps->hfile < 0) return false;
+
+	// Sections from start to end are wanted, the text still returns them all
+	maps->query = query;
+	maps->start = start;
+	maps->end = end;
+	maps->text = NULL;
+	maps->next = start;
+	maps->loaded = false;
+
+	return true;
+}
+
+void maps_openmem(struct mapsreader *maps, const char *text, size_t textlen)
+{
+	maps->hfile = -1;
+	maps->query = false;
+	maps->text = text;
+	maps->textlen = textlen;
+	maps->start = 0;
+	maps->end = UINT64_MAX;
+	maps->next = 0;
+	maps->loaded = false;
+}
+
+void maps_rewind(struct mapsreader *maps)
+{
+	if (maps->hfile >= 0) lseek(maps->hfile, 0, SEEK_SET);
+
+	maps->next = maps->start;
+	maps->loaded = false;
+}
+
+void maps_close(struct mapsreader *maps)
+{
+	if (maps->hfile >= 0) close(maps->hfile);
+
+	maps->hfile = -1;
+	maps->text = NULL;
+	maps->loaded = false;
+}
+
+void maps_free(struct mapsreader *maps)
+{
+	maps_close(maps);
+
+	if (maps->buf != NULL) free(maps->buf);
+	maps->buf = NULL;
+	maps->size = 0;
+}
+
+bool maps_load(struct mapsreader *maps)
+{
+	char *grown;
+	size_t size;
+	ssize_t b;
+
+	maps->len = 0;
+	maps->pos = 0;
+
+	if (maps->text != NULL) {
+		// Copy text held in memory, lines are split in place
+		if (maps->size < maps->textlen + 1) {
+			grown = (char *) realloc(maps->buf, maps->textlen + 1);
+			if (grown == NULL) return false;
+			maps->buf = grown;
+			maps->size = maps->textlen + 1;
+		}
+
+		memcpy(maps->buf, maps->text, maps->textlen);
+		maps->len = maps->textlen;
+
+	} else {
+		// Read the whole file in large reads, the buffer is kept for the next process
+		while (1) {
+			if (maps->size - maps->len < MAPS_READ + 1) {
+				size = (maps->size != 0 ? maps->size * 2 : MAPS_BUFSIZE);
+				grown = (char *) realloc(maps->buf, size);
+				if (grown == NULL) return false;
+				maps->buf = grown;
+				maps->size = size;
+			}
+
+			b = read(maps->hfile, maps->buf + maps->len, maps->size - maps->len - 1);
+			if (b < 0 && errno == EINTR) continue;
+			if (b < 0) return false;
+			if (b == 0) break;
+			maps->len += b;
+		}
+	}
+
+	maps->buf[maps->len] = '\x0';
+	maps->loaded = true;
+
+	return true;
+}
+
+uint64_t maps_hex(char *text, char **end)
+{
+	uint64_t value = 0;
+	int digit;
+
+	for (;; text++) {
+		if (*text >= '0' && *text <= '9') digit = *text - '0';
+		else if (*text >= 'a' && *text <= 'f') digit = *text - 'a' + 10;
+		else break;
+
+		value = (value << 4) | digit;
+	}
+
+	*end = text;
+
+	return value;
+}
+
+bool maps_parse(struct mapsreader *maps, struct vmainfo *vma)
+{
+	char *line;
+	char *eol;
+	char *end;
+	int field;
+
+	if (!maps->loaded && !maps_load(maps)) return false;
+
+	while (maps->pos < maps->len) {
+		// Split off the next line
+		line = maps->buf + maps->pos;
+		eol = (char *) memchr(line, '\n', maps->len - maps->pos);
+		if (eol == NULL) eol = maps->buf + maps->len;
+		*eol = '\x0';
+		maps->pos = eol - maps->buf + 1;
+		maps->last = eol - line + 1;
+
+		// Get range
+		vma->start = maps_hex(line, &end);
+		if (*end != '-') continue;
+		vma->end = maps_hex(end + 1, &end);
+		if (*end != ' ') continue;
+
+		// Get perms
+		vma->perms = end + 1;
+		end = strchr(vma->perms, ' ');
+		if (end == NULL) continue;
+		*end = '\x0';
+
+		// Skip offset, device and inode, the padded name follows if there is one
+		for (field = 0; field < 3 && end != NULL; field++) end = strchr(end + 1, ' ');
+		while (end != NULL && *end == ' ') ++end;
+		vma->name = (end != NULL && *end != '\x0' ? end : "[Anonymous]");
+
+		// Sections before the range or already returned by PROCMAP_QUERY
+		if (vma->end <= maps->next) continue;
+
+		return true;
+	}
+
+	return false;
+}
+
+bool maps_query(struct mapsreader *maps, struct vmainfo *vma)
+{
+	struct procmap_query query;
+
+	memset(&query, 0, sizeof(query));
+	query.size = sizeof(query);
+	query.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+	query.query_addr = maps->next;
+	query.vma_name_addr = (uintptr_t) maps->name;
+	query.vma_name_size = sizeof(maps->name);
+
+	if (ioctl(maps->hfile, PROCMAP_QUERY, &query) != 0) {
+		if (errno == ENOENT) return false;
+
+		// Carry on from the text, skipping sections already returned
+		maps->query = false;
+		return maps_parse(maps, vma);
+	}
+
+	if (query.vma_start >= maps->end) return false;
+
+	vma->start = query.vma_start;
+	vma->end = query.vma_end;
+	maps->next = query.vma_end;
+
+	maps->perms[0] = (query.vma_flags & PROCMAP_QUERY_VMA_READABLE ? 'r' : '-');
+	maps->perms[1] = (query.vma_flags & PROCMAP_QUERY_VMA_WRITABLE ? 'w' : '-');
+	maps->perms[2] = (query.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE ? 'x' : '-');
+	maps->perms[3] = (query.vma_flags & PROCMAP_QUERY_VMA_SHARED ? 's' : 'p');
+	maps->perms[4] = '\x0';
+	vma->perms = maps->perms;
+
+	vma->name = (query.vma_name_size > 1 ? maps->name : "[Anonymous]");
+	maps->last = sizeof(query) + query.vma_name_size;
+
+	return true;
+}
+
+bool maps_next(struct mapsreader *maps, struct vmainfo *vma, struct profile *prof)
+{
+	uint64_t start = prof_start(prof);
+	bool found;
+
+	if (maps->query) found = maps_query(maps, vma);
+	else found = maps_parse(maps, vma);
+
+	prof_end(prof, PROF_MAPS, start, found ? maps->last : 0);
+
+	return found;
+}
+
+bool mapquery_probe()
+{
+	struct procmap_query query;
+	char name[PATH_MAX + 1];
+	int hmaps;
+	int result;
+
+	hmaps = open("/proc/self/maps", O_RDONLY);
+	if (hmaps < 0) return false;
+
+	// Look up the section holding the name buffer
+	memset(&query, 0, sizeof(query));
+	query.size = sizeof(query);
+	query.query_addr = (uintptr_t) name;
+	query.vma_name_addr = (uintptr_t) name;
+	query.vma_name_size = sizeof(name);
+
+	result = ioctl(hmaps, PROCMAP_QUERY, &query);
+
+	close(hmaps);
+
+	return result == 0;
+}
+
+int scanctx_open(struct global *globals, struct scanctx *ctx)
+{
+	char path[PATH_MAX + 1];
+	bool query;
+
+	// Forget the last huge page seen
+	ctx->hunit.pages = 0;
+
+	if (ctx->hpagemap >= 0 && ctx->opentid == ctx->tid) {
+		// Reuse files kept open from the last scan
+		maps_rewind(&ctx->maps);
+		return 0;
+	}
+
+	scanctx_close(ctx);
+
+	if (globals->snap != NULL) {
+		// Read the page map and maps from the snapshot
+		ctx->hpagemap = dup(globals->snap->hfile);
+		ctx->opentid = ctx->tid;
+		maps_openmem(&ctx->maps, globals->snap->base + globals->snap->hdr->mapsoff, globals->snap->hdr->mapslen);
+
+		if (ctx->hpagemap == -1) {
+			fprintf(stderr, "Error opening snapshot maps: ");
+			perror(NULL);
+			return RET_SNAPSHOT;
+		}
+
+		return 0;
+	}
+
+	// Open page mapping
+	sprintf(path, "/proc/%" PRIu64 "/pagemap", ctx->tid);
+	ctx->hpagemap = open(path, O_RDONLY);
+	if (ctx->hpagemap == -1) {
+		if(!globals->list || errno != EACCES){
+			fprintf(stderr, "Error opening %s: ", path);
+			perror(NULL);
+		}
+		return RET_PAGEMAP;
+	}
+
+	ctx->opentid = ctx->tid;
+
+	// Open maps, snapshots keep the maps text so capture reads that
+	sprintf(path, "/proc/%" PRIu64 "/maps", ctx->tid);
+	query = globals->mapquery && globals->capture == NULL && (globals->rangestart != 0 || globals->rangeend != UINT64_MAX);
+	if (!maps_open(&ctx->maps, path, query, globals->rangestart, globals->rangeend)) {
+		if(!globals->list){
+			fprintf(stderr, "Error opening %s: ", path);
+			perror(NULL);
+		}
+		return RET_MAPS;
+	}
+
+	return 0;
+}
+
+void scanctx_close(struct scanctx *ctx)
+{
+	if (ctx->hpagemap >= 0) close(ctx->hpagemap);
+	maps_close(&ctx->maps);
+
+	ctx->hpagemap = -1;
+}
+
+void scanctx_destroy(struct scanctx *ctx)
+{
+	scanctx_close(ctx);
+	maps_free(&ctx->maps);
+
+	if (ctx->pmbuf != NULL) free(ctx->pmbuf);
+	if (ctx->pmdata != NULL) free(ctx->pmdata);
+	if (ctx->pmregions != NULL) free(ctx->pmregions);
+	if (ctx->kpreq != NULL) free(ctx->kpreq);
+	if (ctx->kprun != NULL) free(ctx->kprun);
+	if (ctx->kpcount != NULL) free(ctx->kpcount);
+	if (ctx->kpflags != NULL) free(ctx->kpflags);
+	if (ctx->kpgot != NULL) free(ctx->kpgot);
+	if (ctx->kpidle != NULL) free(ctx->kpidle);
+	if (ctx->diffbuf != NULL) free(ctx->diffbuf);
+	if (ctx->xrefbuf != NULL) free(ctx->xrefbuf);
+	if (ctx->prof != NULL) free(ctx->prof);
+	free(ctx);
 }
 
 int dumpall_filter(const struct dirent *entry)
@@ -306,22 +2221,28 @@ int dumpall_cmp(const struct dirent **one, const struct dirent **two)
 	return 1;
 }
 
-int dumpall(struct global *globals)
+int dumpall(struct global *globals, struct scanctx *ctx)
 {
 	int result = RET_OK;
 	bool needhdg = true;
 	int printed = 0;
 	int statwidth;
 	int procwidth;
+	struct listjob *jobs = NULL;
+	int njobs = 0;
+	int loop;
+	struct profile *prof = (globals->profile ? &globals->prof : NULL);
+	uint64_t profstart;
 	
 	statwidth = 10;
 	if (globals->threads) statwidth += 1 + 10;
 	statwidth += 2 * (1 + 8);
 	if (globals->hkpagecount >= 0) statwidth += 2 * (1 + 8);
 	if (globals->hkpageflags >= 0) statwidth += 3 * (1 + 8);
+	statwidth += globals->nnodes * (1 + 8);
 	statwidth += 1 + 8 + 1;
 	
-	if(globals->terminal) {
+	if(globals->terminal && globals->format == OUT_TEXT) {
 		procwidth = globals->termwidth - statwidth;
 		if (procwidth < 10) procwidth = 0;
 	} else {
@@ -330,711 +2251,5026 @@ int dumpall(struct global *globals)
 	
 	globals->list = true;
 
-	if (globals->pid != 0) {
-		result = dumpall_pid_threads(globals, globals->pid, &printed, &needhdg, procwidth);
+	if (globals->iteration > 0 && globals->format == OUT_TEXT) {
+		// New heading for each interval
+		printf("\n");
+		needhdg = true;
+	}
 
-	} else {
-		struct dirent **entries = NULL;
+	// Cache kernel page details across processes for the whole run
+	if (globals->kcache != NULL) kcache_destroy(globals->kcache);
+	globals->kcache = NULL;
+
+	if (globals->hkpagecount >= 0 || globals->hkpageflags >= 0) {
+		globals->kcache = kcache_create();
+	}
+
+	if (globals->xrefmode != 0 || globals->groupby != 0) {
+		// Build a reverse PFN index while scanning
+		globals->xref = xref_create();
+		if (globals->xref == NULL) return RET_NOMEM;
+	}
+
+	if (globals->pid != 0) {
+		// Single process
+		njobs = 1;
+		jobs = (struct listjob *) calloc(1, sizeof(struct listjob));
+		if (jobs == NULL) return RET_NOMEM;
+
+		jobs[0].pid = globals->pid;
+
+	} else {
+		struct dirent **entries = NULL;
 		int nent;
-		int loop;
 
+		profstart = prof_start(prof);
 		nent = scandir("/proc", &entries, dumpall_filter, dumpall_cmp);
+		prof_end(prof, PROF_PROCS, profstart, 0);
 
 		if (nent < 0) {
 			// Failed to scan /proc
 			fprintf(stderr, "Error scanning /proc: ");
 			perror(NULL);
-			result = RET_PROCSCAN;
+			return RET_PROCSCAN;
+		}
 
-		} else {
-			// Loop each entry in /proc
-			for (loop = 0; loop < nent; loop++) {
-				uint64_t pid = strtoull(entries[loop]->d_name, NULL, 10);
+		// Build a job for each entry in /proc
+		jobs = (struct listjob *) calloc(nent > 0 ? nent : 1, sizeof(struct listjob));
 
-				if (globals->threads) {
-					// Dump all threads for this PID
-					dumpall_pid_threads(globals, pid, &printed, &needhdg, procwidth);
-				} else {
-					// Just dump this PID
-					dumpall_pid(globals, pid, pid, &printed, &needhdg, procwidth);
-				}
+		for (loop = 0; loop < nent; loop++) {
+			if (jobs != NULL) jobs[loop].pid = strtoull(entries[loop]->d_name, NULL, 10);
+			free(entries[loop]);
+		}
 
-				free(entries[loop]);
+		if (entries != NULL) free(entries);
+
+		if (jobs == NULL) return RET_NOMEM;
+		njobs = nent;
+	}
+
+	if (globals->topkey != 0) {
+		// Only the largest processes
+		result = dumpall_top(globals, ctx, jobs, njobs, procwidth, &printed, &needhdg);
+
+	} else if (globals->jobs > 1 && njobs > 1) {
+		// Scan processes on a worker pool
+		result = dumpall_parallel(globals, ctx, jobs, njobs, procwidth, &printed, &needhdg);
+
+	} else {
+		// Scan processes in turn
+		for (loop = 0; loop < njobs; loop++) {
+			if (dumpall_job(globals, ctx, &jobs[loop], procwidth) != RET_OK && globals->pid != 0) {
+				result = RET_PROCSCAN;
 			}
 
+			dumpall_print(globals, &jobs[loop], &printed, &needhdg);
 		}
-
-		if (entries != NULL) free(entries);
 	}
 
+	free(jobs);
+
+	// Answer queries on the reverse PFN index
+	if (globals->xref != NULL && result == RET_OK) result = xref_report(globals);
+
 	return result;
 }
 
-int dumpall_pid_threads(struct global *globals, uint64_t pid, int *printed, bool *needhdg, int procwidth)
+int dumpall_parallel(struct global *globals, struct scanctx *ctx, struct listjob *jobs, int njobs, int procwidth, int *printed,
+                     bool *needhdg)
 {
-	int result = RET_OK;
-	char path[PATH_MAX + 1];
-	struct dirent **entries = NULL;
-	int nent;
+	struct listpool pool;
+	pthread_t *threads;
+	int nthreads;
+	int started = 0;
 	int loop;
+	int job;
+
+	nthreads = globals->jobs;
+	if (nthreads > njobs) nthreads = njobs;
+
+	threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+	if (threads == NULL) return RET_NOMEM;
+
+	pool.globals = globals;
+	pool.jobs = jobs;
+	pool.njobs = njobs;
+	pool.nextjob = 0;
+	pool.procwidth = procwidth;
+	pool.running = nthreads;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.jobdone, NULL);
+
+	// Start workers
+	for (loop = 0; loop < nthreads; loop++) {
+		if (pthread_create(&threads[started], NULL, dumpall_worker, &pool) == 0) ++started;
+	}
 
-	sprintf(path, "/proc/%" PRIu64 "/task", pid);
+	pthread_mutex_lock(&pool.lock);
+	pool.running -= nthreads - started;
+	pthread_mutex_unlock(&pool.lock);
 
-	nent = scandir(path, &entries, dumpall_filter, dumpall_cmp);
+	if (started == 0) fprintf(stderr, "Error: Unable to start worker threads, scanning processes in turn\n");
 
-	if (nent < 0) {
-		// Failed to scan /proc/n/task
-		fprintf(stderr, "Error scanning %s: ", path);
-		perror(NULL);
-		result = RET_PROCSCAN;
+	// Print results in PID order as they complete
+	for (loop = 0; loop < njobs; loop++) {
+		pthread_mutex_lock(&pool.lock);
 
-	} else {
-		// Loop each entry in /proc/n/task
-		for (loop = 0; loop < nent; loop++) {
-			uint64_t tid = strtoull(entries[loop]->d_name, NULL, 10);
+		while (!jobs[loop].done) {
+			if (pool.running > 0) {
+				pthread_cond_wait(&pool.jobdone, &pool.lock);
+				continue;
+			}
 
-			// Just dump this TID
-			dumpall_pid(globals, pid, tid, printed, needhdg, procwidth);
+			// No workers left, take the next job here
+			job = pool.nextjob++;
+			pthread_mutex_unlock(&pool.lock);
 
-			free(entries[loop]);
+			dumpall_job(globals, ctx, &jobs[job], procwidth);
+
+			pthread_mutex_lock(&pool.lock);
+			jobs[job].done = true;
 		}
 
+		pthread_mutex_unlock(&pool.lock);
+
+		dumpall_print(globals, &jobs[loop], printed, needhdg);
+	}
+
+	for (loop = 0; loop < started; loop++) {
+		pthread_join(threads[loop], NULL);
 	}
 
-	if (entries != NULL) free(entries);
+	pthread_cond_destroy(&pool.jobdone);
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
 
-	return result;
+	return RET_OK;
 }
 
-void dumpall_pid(struct global *globals, uint64_t pid, uint64_t tid, int *printed, bool *needhdg, int procwidth)
+int topcand_cmp(const void *one, const void *two)
 {
-	if (*needhdg) {
-		printf("====== PID");
-		
-		if (globals->threads) {
-			printf("        TID");
-		}
+	const struct topcand *cand1 = (const struct topcand *) one;
+	const struct topcand *cand2 = (const struct topcand *) two;
 
-		printf("     Size  Present");
+	// Largest bound first
+	if (cand1->bound > cand2->bound) return -1;
+	if (cand1->bound < cand2->bound) return 1;
+	return 0;
+}
 
-		if (globals->hkpagecount >= 0) {
-			printf("  Private  Average");
-		}
+int dumpall_top(struct global *globals, struct scanctx *ctx, struct listjob *jobs, int njobs, int procwidth, int *printed,
+                bool *needhdg)
+{
+	struct toppool pool;
+	struct mapsreader maps;
+	struct listjob job;
+	struct profile *prof = (globals->profile ? &globals->prof : NULL);
+	pthread_t *threads;
+	uint64_t profstart;
+	uint64_t cpuslack;
+	long ncpus;
+	int nthreads;
+	int started = 0;
+	int loop;
 
-		if (globals->hkpageflags >= 0) {
-			printf("     Anon    Ref'd     Huge");
+	// Counter drift across all CPUs
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (ncpus < 1) ncpus = 1;
+	cpuslack = (uint64_t) ncpus * (2 * ncpus > TOP_CPUBATCH ? 2 * ncpus : TOP_CPUBATCH) * getpagesize();
+
+	// No more kept than there are processes
+	pool.maxheap = ((int) globals->topn < njobs ? (int) globals->topn : njobs);
+
+	pool.cands = (struct topcand *) malloc((njobs > 0 ? njobs : 1) * sizeof(struct topcand));
+	pool.heap = (struct listjob *) calloc(pool.maxheap > 0 ? pool.maxheap : 1, sizeof(struct listjob));
+	threads = (pthread_t *) malloc((globals->jobs > 1 ? globals->jobs : 1) * sizeof(pthread_t));
+
+	if (pool.cands == NULL || pool.heap == NULL || threads == NULL) {
+		if (pool.cands != NULL) free(pool.cands);
+		if (pool.heap != NULL) free(pool.heap);
+		if (threads != NULL) free(threads);
+		fprintf(stderr, "Error: Unable to allocate process ranking\n");
+		return RET_NOMEM;
+	}
+
+	// Rank processes by the kernel's memory counters, which are cheap to read
+	profstart = prof_start(prof);
+	memset(&maps, 0, sizeof(maps));
+	pool.ncands = 0;
+
+	for (loop = 0; loop < njobs; loop++) {
+		if (top_bound(globals, &maps, jobs[loop].pid, cpuslack, &pool.cands[pool.ncands].bound)) {
+			pool.cands[pool.ncands++].pid = jobs[loop].pid;
 		}
+	}
 
-		printf("  Swapped Process ======\n");
-		*needhdg = false;
+	maps_free(&maps);
+	prof_end(prof, PROF_PROCS, profstart, 0);
+
+	qsort(pool.cands, pool.ncands, sizeof(struct topcand), topcand_cmp);
+
+	pool.globals = globals;
+	pool.nextcand = 0;
+	pool.nheap = 0;
+	pool.procwidth = procwidth;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	// Start helper threads, this thread scans processes too
+	nthreads = globals->jobs - 1;
+	if (nthreads > pool.ncands - 1) nthreads = pool.ncands - 1;
+
+	for (loop = 0; loop < nthreads; loop++) {
+		if (pthread_create(&threads[started], NULL, top_worker, &pool) == 0) ++started;
 	}
 
-	globals->pid = pid;
-	globals->tid = tid;
+	top_run(&pool, ctx);
 
-	if (tid > 0 && dumppid(globals) == 0) {
-		printf(" ");
-		printcmdline(globals->tid, procwidth);
-		printf("\n");
-		if (globals->terminal && globals->termheight > 2 && ++*printed % (globals->termheight - 1) == 0) *needhdg = true;
+	for (loop = 0; loop < started; loop++) {
+		pthread_join(threads[loop], NULL);
+	}
+
+	// Sort the heap in place, largest first
+	for (loop = pool.nheap - 1; loop > 0; loop--) {
+		job = pool.heap[0];
+		pool.heap[0] = pool.heap[loop];
+		pool.heap[loop] = job;
+		top_siftdown(globals, pool.heap, loop, 0);
 	}
+
+	for (loop = 0; loop < pool.nheap; loop++) {
+		dumpall_print(globals, &pool.heap[loop], printed, needhdg);
+	}
+
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free(pool.cands);
+	free(pool.heap);
+
+	return RET_OK;
 }
 
-int dumppid(struct global *globals)
+void *top_worker(void *arg)
 {
-	int result = 0;
-	
-	bool skip;
-	char *end;
-	char path[PATH_MAX + 1];
-	FILE *hmaps = NULL;
-	char *line;
-	size_t linesize;
-	int linelen;
-	uint64_t range[2];
-	uint64_t size;
-	const char *item;
-	char *perms;
-
-	int hpagemap = 0;
-	int b;
-	uint64_t entry;
-	uint64_t npstart;
-	uint64_t offset;
-	uint64_t pfn;
-	uint64_t swapfile;
-	uint64_t swapoff;
-	int present, swapped;
-	unsigned int pagesize = getpagesize();
+	struct toppool *pool = (struct toppool *) arg;
+	struct scanctx *ctx;
 
-	uint64_t pagecnt = 0;
-	uint64_t pageflags;
-	
-	struct sstats stats;
+	ctx = scanctx_create(pool->globals);
 
-	bool gotpagecnt;
-	bool gotpageflags;
+	if (ctx == NULL) {
+		// Leave the processes to the other threads
+		fprintf(stderr, "Error: Unable to allocate scan buffers for a worker thread\n");
+		return NULL;
+	}
 
-	bool incompound = false;
-	bool hdgotpagecnt = false;
-	uint64_t hdpagecnt = 0;
-	uint64_t hdpageflags = 0;
+	top_run(pool, ctx);
+	scanctx_destroy(ctx);
 
-	do{	
-		// Open page mapping
-		sprintf(path, "/proc/%" PRIu64 "/pagemap", globals->tid);
-		hpagemap = open(path, O_RDONLY);
-		if (hpagemap == -1) {
-			if(!globals->list || errno != EACCES){
-				fprintf(stderr, "Error opening %s: ", path);
-				perror(NULL);
-			}
-			result = 10;
-			break;
-		}
+	return NULL;
+}
 
-		// Open maps
-		sprintf(path, "/proc/%" PRIu64 "/maps", globals->tid);
-		hmaps = fopen(path, "r");
-		if (hmaps == NULL) {
-			if(!globals->list){
-				fprintf(stderr, "Error opening %s: ", path);
-				perror(NULL);
-			}
-			result = 11;
-			break;
-		}
+void top_run(struct toppool *pool, struct scanctx *ctx)
+{
+	struct global *globals = pool->globals;
+	struct listjob job;
+	int next;
 
-		// Clear stats
-		clearstats(&stats);
+	while (1) {
+		// Take the next process in rank order, stopping once none left can beat the smallest kept
+		pthread_mutex_lock(&pool->lock);
 
-		if (globals->list) {
-			if (globals->pid != globals->last_pid) {
-				printf("%10" PRIu64, globals->pid);
-				globals->last_pid = globals->pid;
-			} else {
-				printf("          ");
-			}
+		next = pool->nextcand;
 
-			if (globals->threads) {
-				printf(" %10" PRIu64, globals->tid);
-			}
+		if (next < pool->ncands && pool->nheap == pool->maxheap &&
+		    pool->cands[next].bound <= top_value(globals, &pool->heap[0])) {
+			pool->nextcand = pool->ncands;
 		}
 
-		line = NULL;
-		linesize = 0;
-		while (1){
-			if (getline(&line, &linesize, hmaps) == -1) break;
-			linelen = strlen(line);
+		next = pool->nextcand++;
+		pthread_mutex_unlock(&pool->lock);
 
-			// Convert 0x0a to null
-			line[--linelen] = '\x0';
-			if (linelen > 74) item = line + 73;
-			else item = "[Anonymous]";
+		if (next >= pool->ncands) break;
 
-			// Get range start
-			errno = 0;
-			range[0] = strtoull(line, &end, 16);
-			if (errno != 0) continue;
+		memset(&job, 0, sizeof(job));
+		job.pid = pool->cands[next].pid;
+		dumpall_job(globals, ctx, &job, pool->procwidth);
 
-			// Get range end
-			++end;
-			errno = 0;
-			range[1] = strtoull(end, &end, 16);
-			if (errno != 0) continue;
+		// Keep the largest in a min heap
+		pthread_mutex_lock(&pool->lock);
 
-			// Calculate size
-			size = range[1] - range[0];
+		if (job.nrows == 0) {
+			// Exited or unreadable
+			top_drop(globals, &job);
 
-			// Get perms
-			perms = ++end;
-			end = strchr(perms, ' ');
-			*end = '\x0';
+		} else if (pool->nheap < pool->maxheap) {
+			pool->heap[pool->nheap++] = job;
+			top_siftup(globals, pool->heap, pool->nheap - 1);
 
-			if (globals->writable && strchr(perms, 'w') == NULL) skip = true;
-			else skip = false;
+		} else if (top_value(globals, &job) > top_value(globals, &pool->heap[0])) {
+			top_drop(globals, &pool->heap[0]);
+			pool->heap[0] = job;
+			top_siftdown(globals, pool->heap, pool->nheap, 0);
 
-			if ((globals->verbose || globals->summary || globals->map) && !skip) {
-				// Print section header
-				printf("==================== %s [%s] ", item, perms);
-				printsize(size);
-				printf(" ====================\n");	
-			}
-			stats.size += size;
+		} else {
+			top_drop(globals, &job);
 
-			lseek64(hpagemap, (range[0] / pagesize) * sizeof(uint64_t), SEEK_SET);
-			offset = range[0];
-			npstart = UINT64_MAX;
-			while (offset < range[1]){
-				b = read(hpagemap, &entry, sizeof(uint64_t));
-				if (b <= 0) break;
-
-				// Unpack common bits
-				present = (entry & 0x8000000000000000LL) >> 62;
-				swapped = (entry & 0x4000000000000000LL) >> 61;
-				
-				if (!present && !swapped) {
-					// Page not present in physical ram or swap
-					if(npstart == UINT64_MAX) npstart = offset;
-					if(globals->map && !skip) printf(".");
+		}
 
-				} else {
-					// Page is in physical ram or swap
-					flushnp(globals, &npstart, offset, skip);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
 
-					if (globals->verbose && !skip) {
-						// Print page address
-						printf("   %016" PRIx64 "-%016" PRIx64, offset, offset + pagesize - 1);
-					}
+bool top_bound(struct global *globals, struct mapsreader *maps, uint64_t pid, uint64_t cpuslack, uint64_t *bound)
+{
+	char path[PATH_MAX + 1];
+	char line[128];
+	const char *field;
+	FILE *hfile;
+	uint64_t value = 0;
+	uint64_t hugetlb = 0;
+	uint64_t threads = 1;
+	bool found = false;
+
+	// Resident pages bound present, private and huge memory, kernel threads have no counters
+	if (globals->topkey == TOP_ANON) field = "RssAnon: %" SCNu64;
+	else if (globals->topkey == TOP_SWAPPED) field = "VmSwap: %" SCNu64;
+	else field = "VmRSS: %" SCNu64;
+
+	sprintf(path, "/proc/%" PRIu64 "/status", pid);
+	hfile = fopen(path, "r");
+	if (hfile == NULL) return false;
+
+	// Threads follows the other fields
+	while (fgets(line, sizeof(line), hfile) != NULL) {
+		if (sscanf(line, field, &value) == 1) found = true;
+		if (sscanf(line, "HugetlbPages: %" SCNu64, &hugetlb) == 1) continue;
+		if (sscanf(line, "Threads: %" SCNu64, &threads) == 1) break;
+	}
 
-					if (present) {
-						// Page is present in RAM
-						stats.present += pagesize;
-						
-						// Get PFN
-						pfn = entry & 0x007fffffffffffffLL;
-
-						if (globals->verbose && !skip) {
-							// Print PFN
-							printf(", Present");
-
-							if (pfn != 0) {
-								printf(" (pfn %016" PRIx64 ")", pfn);
-							}
-						}
-
-						gotpagecnt = false;
-						if (globals->hkpagecount >= 0) {
-							// Get page reference count if we can
-							lseek64(globals->hkpagecount, pfn * sizeof(uint64_t), SEEK_SET);						
-							b = read(globals->hkpagecount, &pagecnt, sizeof(uint64_t));
-							if (b == sizeof(uint64_t)){
-								gotpagecnt = true;
-							}
-						}
-
-						gotpageflags = false;
-						if (globals->hkpageflags >= 0) {
-							// Get page flags if we can
-							lseek64(globals->hkpageflags, pfn * sizeof(uint64_t), SEEK_SET);						
-							b = read(globals->hkpageflags, &pageflags, sizeof(uint64_t));
-							if (b == sizeof(uint64_t)){
-								gotpageflags = true;
-							}
-						}
-
-						// Print present marker
-						if(globals->map && !skip) {
-							// If swapped or SWAPCACHE print 'B'
-							if (swapped || (gotpageflags && (pageflags & (1 << 13)))) printf("B");
-							else printf("P");
-						}
-
-						if (gotpageflags) {
-							if (pageflags & (1 << 15)) {
-								// Compound head
-								incompound = true;
-								hdpageflags = pageflags;
-								hdgotpagecnt = gotpagecnt;
-								hdpagecnt = pagecnt;
-
-							} else if(incompound && pageflags & (1 << 16)){
-								// Compound tail, use hdpageflags from header
-
-							} else {
-								// Not compound
-								incompound = false;
-								hdpageflags = pageflags;
-								hdgotpagecnt = gotpagecnt;
-								hdpagecnt = pagecnt;
-
-							}
-
-						} else {
-							// Page flags not available
-							incompound = false;
-							hdgotpagecnt = gotpagecnt;
-							hdpagecnt = pagecnt;
-
-						}
-
-						if (gotpagecnt) {
-							if (globals->verbose && !skip) {
-								// Print reference count
-								printf(", RefCnt %" PRIu64, pagecnt);
-							}
-
-							if (hdgotpagecnt) {
-								// Accumulate private stats
-								if (hdpagecnt <= 1) stats.priv += pagesize;
-								if (hdpagecnt >= 1) stats.privavg += (pagesize << 8) / hdpagecnt;
-							}
-						}
-
-						if (gotpageflags) {
-							if (globals->verbose && !skip) {
-								// Print page flags
-								printf(", Flags ");
-								dumpflags(pageflags);
-							}
-
-							// Accumulate anonymous memory
-							if(hdpageflags & (1 << 12)) stats.anon += pagesize;
-
-							// Accumulate referenced memory
-							if(hdpageflags & (1 << 2)) stats.refd += pagesize;
-
-							// Accumulate huge pages
-							if(hdpageflags & (1 << 17 | 1 << 22)) stats.huge += pagesize;
-						}
+	fclose(hfile);
 
-					}
+	if (!found) return false;
 
-					if (swapped) {
-						// Page is in swap space
-						if (!present) {
-							stats.swapped += pagesize;
-							if(globals->map && !skip) printf("S");
-						}
-
-						// Unpack swap file and offset
-						swapfile = entry & 0x000000000000001fLL;
-						swapoff = (entry & 0x007fffffffffffe0LL) >> 5;
-
-						if(globals->verbose && !skip) {
-							// Print swap details
-							printf(", Swapped (seg %u offs %016" PRIx64 ")", (unsigned int) swapfile, swapoff);
-						}
-					}
-					
-					if (globals->verbose && !skip) {
-						printf("\n");
-					}
-				}
-				
-				// Move to next page
-				offset+=pagesize;
-			}
+	// Upper bound on the pages the scan can find, hugetlb pages are left out of the resident and anon counters
+	*bound = value * 1024 + cpuslack + threads * TOP_THREADBATCH * getpagesize();
+	if (globals->topkey != TOP_SWAPPED) *bound += hugetlb * 1024;
+	if (globals->topkey != TOP_ANON && globals->topkey != TOP_SWAPPED) *bound += top_uncounted(maps, pid);
 
-			// Write not present range
-			flushnp(globals, &npstart, offset, skip);
+	return true;
+}
 
-			if (globals->map && !skip) printf("\n");
+uint64_t top_uncounted(struct mapsreader *maps, uint64_t pid)
+{
+	char path[PATH_MAX + 1];
+	struct vmainfo vma;
+	uint64_t size = 0;
 
-			if (globals->summary) {
-				// Print summary details
-				if(skip) clearstats(&stats);
-				else dumpstats(globals, &stats);
-			}
-		}
+	sprintf(path, "/proc/%" PRIu64 "/maps", pid);
+	if (!maps_open(maps, path, false, 0, UINT64_MAX)) return 0;
 
-		if (line) free(line);
+	while (maps_next(maps, &vma, NULL)) {
+		// PFN mapped device, driver and kernel sections
+		if (strncmp(vma.name, "/dev/", 5) == 0 || strncmp(vma.name, "/sys/", 5) == 0 ||
+		    strncmp(vma.name, "anon_inode:", 11) == 0 || strncmp(vma.name, "[vvar", 5) == 0) {
+			size += vma.end - vma.start;
 
-		if (!globals->summary && !globals->map) {
-			if (!globals->list) {
-				printf("============ Totals ============\n");
-			}
+		// Readable private anonymous memory can map the shared zero page
+		} else if (vma.name[0] == '[' && vma.perms[0] == 'r' && vma.perms[3] == 'p') {
+			size += vma.end - vma.start;
 
-			// Print totals
-			dumpstats(globals, &stats);
 		}
-	} while(0);
+	}
 
-	if (hpagemap >= 0) close(hpagemap);
-	if (hmaps != NULL) fclose(hmaps);
-		
-	return result;
+	maps_close(maps);
+
+	return size;
 }
 
-void dumpstats(struct global *globals, struct sstats *stats)
+uint64_t top_value(struct global *globals, struct listjob *job)
 {
-	if (globals->list) {
-		printf(" %8" PRIu64 " %8" PRIu64, stats->size / 1024, stats->present / 1024);
-		
-		if (globals->hkpagecount >= 0) {
-			printf(" %8" PRIu64 " %8" PRIu64, stats->priv / 1024, (stats->privavg >> 8) / 1024);
-		}
-		
-		if (globals->hkpageflags >= 0) {
-			printf(" %8" PRIu64 " %8" PRIu64 " %8" PRIu64, stats->anon / 1024, stats->refd / 1024, stats->huge / 1024);
-		}
-		
-		printf(" %8" PRIu64, stats->swapped / 1024);
+	struct sstats *stats = &job->rows[0].stats;
+
+	switch (globals->topkey) {
+	case TOP_PRIVATE:
+		return stats->priv;
+	case TOP_SWAPPED:
+		return stats->swapped;
+	case TOP_ANON:
+		return stats->anon;
+	case TOP_HUGE:
+		return stats->huge;
+	default:
+		return stats->present;
+	}
+}
 
-	} else{
-		printf("Size:       %8" PRIu64 " kB\n", stats->size / 1024);
-		printf("Present:    %8" PRIu64 " kB (%.1f%%)\n", stats->present / 1024, ((double) stats->present / (double) stats->size) * 100.0);
-		
-		if (globals->hkpagecount >= 0 && stats->present) {
-			printf("  Unique:   %8" PRIu64 " kB (%.1f%%)\n", stats->priv / 1024, ((double) stats->priv / (double) stats->present) * 100.0);
-			printf("  Average:  %8" PRIu64 " kB (%.1f%%)\n", (stats->privavg >> 8) / 1024, ((double) (stats->privavg >> 8) / (double) stats->present) * 100.0);
-		}
-		
-		if (globals->hkpageflags >= 0 && stats->present) {
-			printf("  Anon:     %8" PRIu64 " kB (%.1f%%)\n", stats->anon / 1024, ((double) stats->anon / (double) stats->present) * 100.0);
-			printf("  Huge:     %8" PRIu64 " kB (%.1f%%)\n", stats->huge / 1024, ((double) stats->huge / (double) stats->present) * 100.0);
-			printf("Referenced: %8" PRIu64 " kB (%.1f%%)\n", stats->refd / 1024, ((double) stats->refd / (double) stats->size) * 100.0);
-		}
-		
-		printf("Swapped:    %8" PRIu64 " kB (%.1f%%)\n", stats->swapped / 1024, ((double) stats->swapped / (double) stats->size) * 100.0);
+void top_siftup(struct global *globals, struct listjob *heap, int idx)
+{
+	struct listjob job;
+	int parent;
 
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (top_value(globals, &heap[parent]) <= top_value(globals, &heap[idx])) break;
+
+		job = heap[parent];
+		heap[parent] = heap[idx];
+		heap[idx] = job;
+		idx = parent;
 	}
-	
-	clearstats(stats);
 }
 
-void clearstats(struct sstats *stats)
+void top_siftdown(struct global *globals, struct listjob *heap, int nheap, int idx)
 {
-	stats->size = 0;
-	stats->present = 0;
-	stats->priv = 0;
-	stats->privavg = 0;
-	stats->anon = 0;
-	stats->refd = 0;
-	stats->swapped = 0;
-	stats->huge = 0;
+	struct listjob job;
+	int child;
+
+	while ((child = 2 * idx + 1) < nheap) {
+		// Smaller child
+		if (child + 1 < nheap && top_value(globals, &heap[child + 1]) < top_value(globals, &heap[child])) ++child;
+		if (top_value(globals, &heap[idx]) <= top_value(globals, &heap[child])) break;
+
+		job = heap[child];
+		heap[child] = heap[idx];
+		heap[idx] = job;
+		idx = child;
+	}
 }
 
-void printsize(uint64_t size)
+void top_drop(struct global *globals, struct listjob *job)
 {
-	int mult = 0;
-	const char *unit;
-	
-	while (size > (mult == 0 ? 1024 : 8192)) {
-		size /= 1024;
-		++mult;	
+	int loop;
+
+	// Scanned but not listed, still counts in the profile
+	if (globals->profile && job->attempts != 0) prof_record(globals, job->pid, &job->prof);
+
+	for (loop = 0; loop < job->nrows; loop++) {
+		if (job->rows[loop].cmdline != NULL) free(job->rows[loop].cmdline);
 	}
 
-	switch(mult){
-	case 0:
-		unit="B";
-		break;
-	case 1:
-		unit="kB";
-		break;
-	case 2:
-		unit="MB";
-		break;
-	case 3:
-		unit="GB";
-		break;
-	case 4:
-		unit="TB";
-		break;
-	case 5:
-		unit="PB";
-		break;
-	case 6:
-		unit="EB";
-		break;
-	default:
-		unit="??";
-		break;
+	if (job->rows != NULL) free(job->rows);
+	job->rows = NULL;
+	job->nrows = 0;
+}
+
+void *dumpall_worker(void *arg)
+{
+	struct listpool *pool = (struct listpool *) arg;
+	struct scanctx *ctx;
+	int job;
+
+	ctx = scanctx_create(pool->globals);
+
+	if (ctx == NULL) {
+		// Leave the jobs to the other workers, or to the caller when none are left
+		fprintf(stderr, "Error: Unable to allocate scan buffers for a worker thread\n");
+
+		pthread_mutex_lock(&pool->lock);
+		--pool->running;
+		pthread_cond_broadcast(&pool->jobdone);
+		pthread_mutex_unlock(&pool->lock);
+
+		return NULL;
 	}
-	
-	printf("[%4" PRIu64 " %2s]",size,unit);
+
+	while (1) {
+		// Take the next job
+		pthread_mutex_lock(&pool->lock);
+		job = pool->nextjob++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (job >= pool->njobs) break;
+
+		dumpall_job(pool->globals, ctx, &pool->jobs[job], pool->procwidth);
+
+		// Signal completion
+		pthread_mutex_lock(&pool->lock);
+		pool->jobs[job].done = true;
+		pthread_cond_broadcast(&pool->jobdone);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	scanctx_destroy(ctx);
+
+	return NULL;
 }
 
-void dumpflags(uint64_t flags)
+int dumpall_job(struct global *globals, struct scanctx *ctx, struct listjob *job, int procwidth)
 {
+	int result = RET_OK;
+	char path[PATH_MAX + 1];
+	struct dirent **entries = NULL;
+	int nent;
 	int loop;
-	int first=1;
-	
-	for (loop = 0; loop < 64; loop++) {
-		if (flags & 1) {
-			if(first){
-				printf("[");
-				first = 0;
-			} else{
-				printf(" ");
-			}
-			
-			switch(loop){
-			// Taken from Linux/include/uapi/linux/kernel-page-flags.h:
-			case 0:
-				printf("LOCKED");
-				break;
-			case 1:
-				printf("ERROR");
-				break;
-			case 2:
-				printf("REFERENCED");
-				break;
-			case 3:
-				printf("UPTODATE");
-				break;
-			case 4:
-				printf("DIRTY");
-				break;
-			case 5:
-				printf("LRU");
-				break;
-			case 6:
-				printf("ACTIVE");
-				break;
-			case 7:
-				printf("SLAB");
-				break;
-			case 8:
-				printf("WRITEBACK");
-				break;
-			case 9:
-				printf("RECLAIM");
-				break;
-			case 10:
-				printf("BUDDY");
-				break;
-			case 11:
-				printf("MMAP");
-				break;
-			case 12:
-				printf("ANON");
-				break;
-			case 13:
-				printf("SWAPCACHE");
-				break;
-			case 14:
-				printf("SWAPBACKED");
-				break;
-			case 15:
-				printf("COMPHEAD");
-				break;
-			case 16:
-				printf("COMPTAIL");
-				break;
-			case 17:
-				printf("HUGE");
-				break;
-			case 18:
-				printf("UNEVICTABLE");
-				break;
-			case 19:
-				printf("HWPOISON");
-				break;
-			case 20:
-				printf("NOPAGE");
-				break;
-			case 21:
-				printf("KSM");
-				break;
-			case 22:
-				printf("THP");
-				break;
-			case 23:
-				printf("BALLOON");
-				break;
-			case 24:
-				printf("ZERO_PAGE");
-				break;
+	struct sstats stats;
+	bool scanned = false;
+	uint64_t profstart;
 
-			// Taken from Linux/include/linux/kernel-page-flags.h (subject to change):
-			case 32:
-				printf("RESERVED?");
-				break;
-			case 33:
-				printf("MLOCKED?");
-				break;
-			case 34:
-				printf("MAPPEDTODISK?");
-				break;
-			case 35:
-				printf("PRIVATE?");
-				break;
-			case 36:
-				printf("PRIVATE_2?");
-				break;
-			case 37:
-				printf("OWNER_PRIVATE?");
-				break;
-			case 38:
-				printf("ARCH?");
-				break;
-			case 39:
-				printf("UNCACHED?");
-				break;
-			case 40:
-				printf("SOFTDIRTY?");
-				break;
-				
-			default:
-				printf("<%d>",loop);
-				break;
+	// Profile this process on its own
+	if (ctx->prof != NULL) memset(ctx->prof, 0, sizeof(struct profile));
+	profstart = prof_start(ctx->prof);
+
+	if (!globals->threads) {
+		// Just scan this PID
+		dumpall_addrow(globals, ctx, job, job->pid, procwidth, &stats, true);
+
+	} else {
+		sprintf(path, "/proc/%" PRIu64 "/task", job->pid);
+
+		nent = scandir(path, &entries, dumpall_filter, dumpall_cmp);
+		prof_end(ctx->prof, PROF_PROCS, profstart, 0);
+
+		if (nent < 0) {
+			// Failed to scan /proc/n/task
+			fprintf(stderr, "Error scanning %s: ", path);
+			perror(NULL);
+			result = RET_PROCSCAN;
+
+		} else {
+			// Loop each entry in /proc/n/task. Threads share the address space of the
+			// thread group so it is only scanned once and the other threads reuse the stats
+			for (loop = 0; loop < nent; loop++) {
+				uint64_t tid = strtoull(entries[loop]->d_name, NULL, 10);
+
+				if (scanned) {
+					dumpall_addrow(globals, ctx, job, tid, procwidth, &stats, false);
+				} else {
+					scanned = dumpall_addrow(globals, ctx, job, tid, procwidth, &stats, true);
+				}
+
+				free(entries[loop]);
 			}
+
 		}
 
-		flags >>= 1;
+		if (entries != NULL) free(entries);
 	}
 
-	if (first) printf("[]");
-	else printf("]");
+	if (ctx->prof != NULL) {
+		// Keep the profile with the job until it is printed
+		ctx->prof->ns = prof_now() - profstart;
+		job->prof = *ctx->prof;
+	}
+
+	return result;
 }
 
-void flushnp(struct global *globals, uint64_t *npstart, uint64_t offset, bool skip)
+bool dumpall_addrow(struct global *globals, struct scanctx *ctx, struct listjob *job, uint64_t tid, int procwidth,
+                    struct sstats *stats, bool scan)
 {
-	if (*npstart != UINT64_MAX) {
-		if (globals->verbose && !skip) {
-			printf("   %016" PRIx64 "-%016" PRIx64, *npstart, offset - 1);
-			printf(", Not present ");
-			printsize(offset - *npstart);
-			printf("\n");
+	struct listrow *rows;
+	char path[PATH_MAX + 1];
+	struct stat st;
+	int result;
+	uint64_t profstart;
+
+	ctx->pid = job->pid;
+	ctx->tid = tid;
+	++job->attempts;
+
+	if (tid == 0) return false;
+
+	if (scan) {
+		// Scan the address space
+		result = dumppid(globals, ctx, stats);
+
+		// Hand pages seen to the reverse PFN index
+		if (globals->xref != NULL) xref_flush(globals, ctx);
+
+		if (result != 0) return false;
+
+		// Name the group now, the process may be gone by the time groups are accounted
+		if (globals->groupby != 0) xref_addgroup(globals, (uint32_t) job->pid);
+
+	} else {
+		// Reusing stats, just check the thread still exists
+		sprintf(path, "/proc/%" PRIu64 "/task/%" PRIu64, job->pid, tid);
+		profstart = prof_start(ctx->prof);
+		result = stat(path, &st);
+		prof_end(ctx->prof, PROF_PROCS, profstart, 0);
+		if (result != 0) return false;
+
+	}
+
+	// Add a row to the job
+	rows = (struct listrow *) realloc(job->rows, (job->nrows + 1) * sizeof(struct listrow));
+	if (rows == NULL) return true;
+
+	job->rows = rows;
+	rows[job->nrows].tid = tid;
+	rows[job->nrows].stats = *stats;
+	profstart = prof_start(ctx->prof);
+	rows[job->nrows].cmdline = getcmdline(tid, procwidth);
+	prof_end(ctx->prof, PROF_CMDLINE, profstart, rows[job->nrows].cmdline != NULL ? strlen(rows[job->nrows].cmdline) : 0);
+	++job->nrows;
+
+	return true;
+}
+
+void dumpall_print(struct global *globals, struct listjob *job, int *printed, bool *needhdg)
+{
+	int loop;
+	uint64_t profstart;
+
+	if (job->attempts == 0) return;
+
+	profstart = prof_start(globals->profile ? &job->prof : NULL);
+
+	if (*needhdg && globals->format == OUT_TEXT) dumpall_heading(globals);
+	*needhdg = false;
+
+	for (loop = 0; loop < job->nrows; loop++) {
+		struct listrow *row = &job->rows[loop];
+
+		if (globals->format != OUT_TEXT) {
+			// Structured record for the row
+			dumprecord(globals, REC_PROCESS, job->pid, globals->threads ? row->tid : 0, NULL, &row->stats,
+			           row->cmdline != NULL ? row->cmdline : "<Unknown>");
+			if (row->cmdline != NULL) free(row->cmdline);
+			continue;
 		}
 
-		*npstart = UINT64_MAX;
+		if (*needhdg) dumpall_heading(globals);
+		*needhdg = false;
+
+		if (job->pid != globals->last_pid) {
+			printf("%10" PRIu64, job->pid);
+			globals->last_pid = job->pid;
+		} else {
+			printf("          ");
+		}
+
+		if (globals->threads) {
+			printf(" %10" PRIu64, row->tid);
+		}
+
+		if (globals->interval != 0) dumpdelta(globals, &row->stats, job->pid, row->tid);
+		else dumpstats(globals, &row->stats);
+
+		printf(" %s\n", row->cmdline != NULL ? row->cmdline : "<Unknown>");
+		if (globals->terminal && globals->termheight > 2 && ++*printed % (globals->termheight - 1) == 0) *needhdg = true;
+
+		if (row->cmdline != NULL) free(row->cmdline);
+	}
+
+	if (job->rows != NULL) free(job->rows);
+	job->rows = NULL;
+	job->nrows = 0;
+
+	if (globals->profile) {
+		// Output completes the profile of the process
+		job->prof.ns += prof_end(&job->prof, PROF_OUTPUT, profstart, 0);
+		prof_record(globals, job->pid, &job->prof);
 	}
 }
 
-#define MAX_CMDLINE 200
+void dumpall_heading(struct global *globals)
+{
+	char name[16];
+	int node;
 
-void tidy_buf(char *buf, int b)
+	printf("====== PID");
+	
+	if (globals->threads) {
+		printf("        TID");
+	}
+
+	printf("     Size  Present");
+
+	if (globals->hkpagecount >= 0) {
+		printf("  Private  Average");
+	}
+
+	if (globals->hkpageflags >= 0) {
+		printf("     Anon    Ref'd     Huge");
+	}
+
+	for (node = 0; node < globals->nnodes; node++) {
+		sprintf(name, "Node%d", globals->nodeids[node]);
+		printf(" %8s", name);
+	}
+
+	printf("  Swapped Process ======\n");
+}
+
+int dumppid(struct global *globals, struct scanctx *ctx, struct sstats *totals)
 {
-	char *ch;
-	int loop;
+	int result = 0;
+	
+	struct vmainfo vma;
+	uint64_t size;
 
-	buf[b - 1] = '\x0';
-	for (ch = buf, loop = 0; loop < b - 1; loop++, ch++) {
-		if (*ch == '\x0') *ch = ' ';
-		else if (!isprint(*ch)) *ch = '.';
+	int hpagemap;
+	
+	struct sstats stats;
+	struct scanstate state;
+	uint64_t profstart;
+
+	do{	
+		// Open page mapping and maps, or reuse them from the last scan
+		profstart = prof_start(ctx->prof);
+		result = scanctx_open(globals, ctx);
+		prof_end(ctx->prof, PROF_PROCS, profstart, 0);
+		if (result != 0) break;
+
+		hpagemap = ctx->hpagemap;
+
+		// Clear stats and compound page state
+		clearstats(&stats);
+		clearstate(&state);
+
+		if (globals->summary && globals->iteration > 0 && globals->format == OUT_TEXT) {
+			printf("============ Change in %" PRIu64 "s ============\n", globals->interval);
+		}
+
+		while (maps_next(&ctx->maps, &vma, ctx->prof)){
+			// Sections filtered out are not read at all
+			if (!vma_filter(globals, &vma)) continue;
+
+			// Calculate size of the part left after filtering
+			size = vma.end - vma.start;
+
+			if ((globals->verbose || globals->summary || globals->map) && globals->format == OUT_TEXT) {
+				// Print section header
+				printf("==================== %s [%s] ", vma.name, vma.perms);
+				printsize(size);
+				printf(" ====================\n");	
+			}
+			stats.size += size;
+
+			if (globals->map) mapstart(globals, size / getpagesize());
+
+			if (globals->eststride > 1) {
+				// Read a sample of the section and scale it up
+				scanestimate(globals, ctx, hpagemap, vma.start, vma.end, globals->pmscan, &state, &stats);
+			} else if (globals->jobs > 1 && !globals->list && !globals->verbose && !globals->map && size > SHARD_SIZE) {
+				// Split large sections across threads
+				scanshards(globals, ctx, hpagemap, vma.start, vma.end, globals->pmscan, &state, &stats);
+			} else {
+				scanrange(globals, ctx, hpagemap, vma.start, vma.end, globals->pmscan, &state, &stats, NULL);
+			}
+
+			if (globals->map) mapend(globals);
+
+			if (globals->summary) {
+				// Print summary details
+				profstart = prof_start(ctx->prof);
+				if (globals->format != OUT_TEXT) dumprecord(globals, REC_SECTION, ctx->pid, 0, &vma, &stats, NULL);
+				else if (globals->interval != 0) dumpdelta(globals, &stats, vma.start, vma.end);
+				else dumpstats(globals, &stats);
+				prof_end(ctx->prof, PROF_OUTPUT, profstart, 0);
+			}
+		}
+
+		profstart = prof_start(ctx->prof);
+
+		if (totals != NULL) {
+			// Return totals to the caller
+			*totals = stats;
+
+		} else if (!globals->summary && !globals->map && globals->format != OUT_TEXT) {
+			// Structured totals record
+			dumprecord(globals, REC_TOTALS, ctx->pid, 0, NULL, &stats, NULL);
+
+		} else if (!globals->summary && !globals->map) {
+			if (globals->iteration == 0) printf("============ Totals ============\n");
+			else printf("============ Change in %" PRIu64 "s ============\n", globals->interval);
+
+			// Print totals
+			if (globals->interval != 0) dumpdelta(globals, &stats, 0, 0);
+			else dumpstats(globals, &stats);
+		}
+
+		if (totals == NULL) prof_end(ctx->prof, PROF_OUTPUT, profstart, 0);
+	} while(0);
+
+	// Keep files open between intervals when scanning one process
+	if (result != 0 || globals->interval == 0 || globals->list) scanctx_close(ctx);
+		
+	return result;
+}
+
+int dumpdiff(struct global *globals, struct scanctx *ctx)
+{
+	int result;
+	ssize_t b;
+	struct vmainfo vma;
+	struct dstats stats;
+	struct dstats totals;
+	uint64_t offset;
+	uint64_t entries;
+	uint64_t skip;
+	uint64_t idx;
+	uint64_t now;
+	unsigned int pagesize = getpagesize();
+
+	// Open page mapping and maps, or the snapshot being replayed
+	result = scanctx_open(globals, ctx);
+	if (result != 0) return result;
+
+	memset(&totals, 0, sizeof(totals));
+
+	while (maps_next(&ctx->maps, &vma, ctx->prof)){
+		if (!vma_filter(globals, &vma)) continue;
+
+		if (globals->verbose || globals->summary) {
+			// Print section header
+			printf("==================== %s [%s] ", vma.name, vma.perms);
+			printsize(vma.end - vma.start);
+			printf(" ====================\n");
+		}
+
+		memset(&stats, 0, sizeof(stats));
+
+		for (offset = vma.start; offset < vma.end; offset += entries * pagesize) {
+			entries = (vma.end - offset) / pagesize;
+			if (entries > globals->bufentries) entries = globals->bufentries;
+
+			// Pages the earlier snapshot couldn't read can't be compared
+			skip = snap_unreadable(globals->before, offset / pagesize);
+
+			if (skip > 0) {
+				if (skip < entries) entries = skip;
+				continue;
+			}
+
+			// Block from the earlier snapshot, stopping short of unreadable pages
+			entries = snap_readpagemap(globals->before, ctx->diffbuf, entries, offset / pagesize);
+
+			// Same block of current page map entries
+			b = readpagemap(globals, ctx, ctx->hpagemap, ctx->pmbuf, entries, offset / pagesize);
+			if (b <= 0) break;
+			entries = b / sizeof(uint64_t);
+			if (entries == 0) break;
+
+			// Look up current kernel page counts and flags for the block
+			decodeentries(globals, ctx, entries);
+			lookupkpages(globals, ctx, entries, 0, HUGE_NONE);
+
+			for (idx = 0; idx < entries; idx++) {
+				diffpage(globals, ctx, idx, offset + idx * pagesize, &stats);
+			}
+		}
+
+		if (globals->summary) dumpdiffstats(&stats);
+
+		totals.added += stats.added;
+		totals.dropped += stats.dropped;
+		totals.swapout += stats.swapout;
+		totals.swapin += stats.swapin;
+		totals.moved += stats.moved;
+		totals.reshared += stats.reshared;
 	}
+
+	// Sections of the earlier snapshot that have since been unmapped
+	diffunmapped(globals, ctx, &totals);
+
+	if (!globals->summary) {
+		// Print totals over the time between the snapshots
+		now = (globals->snap != NULL ? globals->snap->hdr->time : (uint64_t) time(NULL));
+		printf("============ Changes in %" PRId64 "s ============\n", (int64_t) (now - globals->before->hdr->time));
+		dumpdiffstats(&totals);
+	}
+
+	scanctx_close(ctx);
+
+	return RET_OK;
 }
 
-bool cmdlinefrom(uint64_t pid, const char* file, char* buf, int width)
+void diffpage(struct global *globals, struct scanctx *ctx, uint64_t idx, uint64_t offset, struct dstats *stats)
 {
-	bool ok = false;
-	int hcmdline;
-	char path[PATH_MAX + 1];
-	int b;
+	uint64_t before = ctx->diffbuf[idx];
+	uint64_t after = ctx->pmbuf[idx];
+	uint64_t oldpfn = before & PM_PFN;
+	uint64_t newpfn = after & PM_PFN;
+	uint64_t oldcount = 0;
+	uint64_t *counter = NULL;
+	const char *change = NULL;
+	unsigned int pagesize = getpagesize();
 
-	sprintf(path, "/proc/%" PRIu64 "/%s", pid, file);
-	hcmdline = open(path, O_RDONLY);
+	if (after & PM_PRESENT) {
+		if (before & PM_PRESENT) {
+			if (oldpfn != newpfn) {
+				// Migrated or compacted
+				counter = &stats->moved;
+				change = "Moved";
 
-	if (hcmdline >= 0) {
-		b = read(hcmdline, buf, width);
+			} else if ((globals->before->hdr->flags & SNAP_KPAGECOUNT) && (ctx->kpgot[idx] & KPAGE_GOTCOUNT)) {
+				// Same page, check whether it is shared differently
+				snap_readkpages(globals->before, true, oldpfn, 1, &oldcount);
+
+				if (oldcount != KPAGE_NONE && oldcount != ctx->kpcount[idx]) {
+					counter = &stats->reshared;
+					change = "Reshared";
+				}
+			}
+
+		} else if (before & PM_SWAPPED) {
+			counter = &stats->swapin;
+			change = "Swapped in";
+
+		} else {
+			counter = &stats->added;
+			change = "Added";
 
-		if (b > 0) {
-			tidy_buf(buf, b);
-			ok = true;
 		}
 
-		close(hcmdline);
+	} else if (after & PM_SWAPPED) {
+		if (before & PM_PRESENT) {
+			counter = &stats->swapout;
+			change = "Swapped out";
+
+		} else if (!(before & PM_SWAPPED)) {
+			counter = &stats->added;
+			change = "Added";
+
+		}
+
+	} else if (before & (PM_PRESENT | PM_SWAPPED)) {
+		counter = &stats->dropped;
+		change = "Dropped";
+
 	}
 
-	return ok;
+	if (counter == NULL) return;
+
+	*counter += pagesize;
+
+	if (globals->verbose) {
+		// Print page address and change
+		printf("   %016" PRIx64 "-%016" PRIx64 ", %s", offset, offset + pagesize - 1, change);
+
+		if (counter == &stats->moved) printf(" (pfn %016" PRIx64 " -> %016" PRIx64 ")", oldpfn, newpfn);
+		if (counter == &stats->reshared) printf(" (RefCnt %" PRIu64 " -> %" PRIu64 ")", oldcount, ctx->kpcount[idx]);
+
+		printf("\n");
+	}
 }
 
-void printcmdline(uint64_t pid, int width)
+void diffunmapped(struct global *globals, struct scanctx *ctx, struct dstats *totals)
 {
-	char *buf;
-	
-	if (width == 0) width = MAX_CMDLINE;
-	buf = (char *) malloc(width);
+	struct mapsreader old;
+	struct vmainfo vma;
+	struct vmainfo cur;
+	struct dstats stats;
+	uint64_t offset;
+	uint64_t gapend;
+	bool havecur;
+	bool gone;
 
-	if (cmdlinefrom(pid, "cmdline", buf, width)) {
-		printf("%s", buf);
-	} else if (cmdlinefrom(pid, "comm", buf, width)) {
-		printf("[%s]", buf);
-	} else {
-		printf("<Unknown>");
+	memset(&old, 0, sizeof(old));
+	maps_openmem(&old, globals->before->base + globals->before->hdr->mapsoff, globals->before->hdr->mapslen);
+
+	// Both lists are in address order, so walk the current sections alongside the earlier ones
+	maps_rewind(&ctx->maps);
+	havecur = maps_next(&ctx->maps, &cur, ctx->prof);
+
+	while (maps_next(&old, &vma, NULL)) {
+		if (!vma_filter(globals, &vma)) continue;
+
+		memset(&stats, 0, sizeof(stats));
+		gone = false;
+
+		for (offset = vma.start; offset < vma.end; offset = gapend) {
+			while (havecur && cur.end <= offset) havecur = maps_next(&ctx->maps, &cur, ctx->prof);
+
+			if (havecur && cur.start <= offset) {
+				// Still mapped, compared above
+				gapend = (cur.end < vma.end ? cur.end : vma.end);
+				continue;
+			}
+
+			gapend = (havecur && cur.start < vma.end ? cur.start : vma.end);
+
+			if (!gone && (globals->verbose || globals->summary)) {
+				// Print section header
+				printf("==================== %s [%s] ", vma.name, vma.perms);
+				printsize(vma.end - vma.start);
+				printf(" unmapped ====================\n");
+			}
+
+			gone = true;
+			diffdropped(globals, ctx, offset, gapend, &stats);
+		}
+
+		if (globals->summary && gone) dumpdiffstats(&stats);
+
+		totals->dropped += stats.dropped;
 	}
 
-	free(buf);
+	maps_free(&old);
 }
+
+void diffdropped(struct global *globals, struct scanctx *ctx, uint64_t start, uint64_t end, struct dstats *stats)
+{
+	uint64_t *buf = ctx->diffbuf;
+	uint64_t offset;
+	uint64_t entries;
+	uint64_t skip;
+	uint64_t idx;
+	uint64_t loop;
+	unsigned int pagesize = getpagesize();
+
+	// Pages present or swapped out in the earlier snapshot are gone
+	for (offset = start; offset < end; offset += entries * pagesize) {
+		entries = (end - offset) / pagesize;
+		if (entries > globals->bufentries) entries = globals->bufentries;
+
+		skip = snap_unreadable(globals->before, offset / pagesize);
+
+		if (skip > 0) {
+			if (skip < entries) entries = skip;
+			continue;
+		}
+
+		entries = snap_readpagemap(globals->before, buf, entries, offset / pagesize);
+
+		for (idx = 0; idx < entries; idx = loop) {
+			for (loop = idx; loop < entries && (buf[loop] & (PM_PRESENT | PM_SWAPPED)); loop++);
+
+			if (loop > idx) {
+				stats->dropped += (loop - idx) * pagesize;
+
+				if (globals->verbose) {
+					printf("   %016" PRIx64 "-%016" PRIx64 ", Dropped\n", offset + idx * pagesize, offset + loop * pagesize - 1);
+				}
+			}
+
+			for (; loop < entries && !(buf[loop] & (PM_PRESENT | PM_SWAPPED)); loop++);
+		}
+	}
+}
+
+void dumpdiffstats(struct dstats *stats)
+{
+	printf("Added:      %8" PRIu64 " kB\n", stats->added / 1024);
+	printf("Dropped:    %8" PRIu64 " kB\n", stats->dropped / 1024);
+	printf("Swap out:   %8" PRIu64 " kB\n", stats->swapout / 1024);
+	printf("Swap in:    %8" PRIu64 " kB\n", stats->swapin / 1024);
+	printf("Moved:      %8" PRIu64 " kB\n", stats->moved / 1024);
+	printf("Reshared:   %8" PRIu64 " kB\n", stats->reshared / 1024);
+}
+
+void scanrange(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+               bool pmscan, struct scanstate *state, struct sstats *stats, struct shard *shard)
+{
+	uint64_t npstart = UINT64_MAX;
+	uint64_t offset = start;
+
+	// Find present and swapped regions in bulk if we can
+	if (pmscan) offset = scanregions(globals, ctx, hpagemap, start, end, state, stats, shard, &npstart);
+
+	// Decode page map entries for the rest
+	if (offset < end) offset = scanentries(globals, ctx, hpagemap, offset, end, HUGE_RUNS, state, stats, shard, &npstart);
+
+	// Write not present range
+	flushnp(globals, &npstart, offset);
+}
+
+uint64_t scanregions(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+                     struct scanstate *state, struct sstats *stats, struct shard *shard, uint64_t *npstart)
+{
+	struct pm_scan_arg arg;
+	struct page_region *region;
+	uint64_t offset = start;
+	uint64_t reached;
+	uint64_t profstart;
+	unsigned int pagesize = getpagesize();
+	bool needentries;
+	int nregions;
+	int loop;
+
+	// Page map entries are only needed for PFNs and swap details
+	needentries = globals->verbose || globals->hkpagecount >= 0 || globals->hkpageflags >= 0 || globals->hpageidle >= 0 ||
+	              globals->xref != NULL || globals->numa;
+
+	while (offset < end) {
+		memset(&arg, 0, sizeof(arg));
+		arg.size = sizeof(arg);
+		arg.start = offset;
+		arg.end = end;
+		arg.vec = (uintptr_t) ctx->pmregions;
+		arg.vec_len = PMSCAN_REGIONS;
+		arg.category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+		arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED | PAGE_IS_HUGE;
+
+		profstart = prof_start(ctx->prof);
+		nregions = ioctl(hpagemap, PAGEMAP_SCAN, &arg);
+		prof_end(ctx->prof, PROF_PAGEMAP, profstart, nregions > 0 ? nregions * sizeof(struct page_region) : 0);
+
+		// Fall back to page map entries on failure, or for a range the walk skipped that is present
+		if (nregions < 0) break;
+		if (nregions == 0 && offset == start && pmscan_skipped(globals, ctx, hpagemap, start)) break;
+		if (nregions == 0 && arg.walk_end <= offset) break;
+
+		for (loop = 0; loop < nregions; loop++) {
+			region = &ctx->pmregions[loop];
+
+			// Pages before the region are not present
+			if (region->start > offset) scanholes(globals, offset, region->start, npstart);
+
+			if (needentries) {
+				reached = scanentries(globals, ctx, hpagemap, region->start, region->end,
+				                      (region->categories & PAGE_IS_HUGE) ? HUGE_REGION : HUGE_NONE, state, stats, shard, npstart);
+				if (reached < region->end) return reached;
+
+			} else {
+				// Account the whole region
+				flushnp(globals, npstart, region->start);
+
+				if (region->categories & PAGE_IS_PRESENT) {
+					stats->present += region->end - region->start;
+					if (globals->map) mappages(globals, 'P', (region->end - region->start) / pagesize);
+
+				} else {
+					stats->swapped += region->end - region->start;
+					if (globals->map) mappages(globals, 'S', (region->end - region->start) / pagesize);
+
+				}
+
+			}
+
+			offset = region->end;
+		}
+
+		// Pages up to where the walk ended are not present
+		if (arg.walk_end > offset) {
+			reached = (arg.walk_end < end ? arg.walk_end : end);
+			scanholes(globals, offset, reached, npstart);
+			offset = reached;
+		}
+	}
+
+	return offset;
+}
+
+void scanholes(struct global *globals, uint64_t start, uint64_t end, uint64_t *npstart)
+{
+	if (*npstart == UINT64_MAX) *npstart = start;
+	if (globals->map) mappages(globals, '.', (end - start) / getpagesize());
+}
+
+uint64_t scanentries(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+                     int huge, struct scanstate *state, struct sstats *stats, struct shard *shard, uint64_t *npstart)
+{
+	ssize_t b;
+	uint64_t entries;
+	uint64_t loop;
+	uint64_t idx;
+	uint64_t next;
+	uint64_t base;
+	uint64_t entry;
+	uint64_t offset = start;
+	uint64_t pfn;
+	uint64_t swapfile;
+	uint64_t swapoff;
+	int present, swapped;
+	unsigned int pagesize = getpagesize();
+
+	uint64_t pagecnt;
+	uint64_t pageflags;
+
+	bool gotpagecnt;
+	bool gotpageflags;
+
+	bool textpage;
+	bool lead;
+	struct scanstate *pgstate;
+	struct sstats *pgstats;
+	int node;
+
+	while (offset < end){
+		// Read a block of page map entries
+		entries = (end - offset) / pagesize;
+		if (entries > globals->bufentries) entries = globals->bufentries;
+
+		b = readpagemap(globals, ctx, hpagemap, ctx->pmbuf, entries, offset / pagesize);
+		if (b <= 0) break;
+		entries = b / sizeof(uint64_t);
+
+		// Find present and swapped pages, then look up kernel page counts and flags for them
+		decodeentries(globals, ctx, entries);
+		lookupkpages(globals, ctx, entries, offset, huge);
+
+		stats->present += ctx->pmcounts.present * pagesize;
+		stats->swapped += ctx->pmcounts.swapped * pagesize;
+
+		// Pages are dumped as text or as structured records
+		textpage = globals->verbose && globals->format == OUT_TEXT;
+
+		base = offset;
+		next = 0;
+
+		for (loop = 0; loop <= ctx->ndata; loop++){
+			idx = (loop < ctx->ndata ? ctx->pmdata[loop] : entries);
+
+			if (idx > next) {
+				// Pages not present in physical ram or swap
+				if(*npstart == UINT64_MAX) *npstart = base + next * pagesize;
+				if(globals->map) mappages(globals, '.', idx - next);
+			}
+
+			if (loop == ctx->ndata) break;
+			next = idx + 1;
+
+			entry = ctx->pmbuf[idx];
+			offset = base + idx * pagesize;
+
+			// Unpack common bits
+			present = (entry & PM_PRESENT) >> 62;
+			swapped = (entry & PM_SWAPPED) >> 61;
+
+			// Page is in physical ram or swap
+			flushnp(globals, npstart, offset);
+
+			if (textpage) {
+				// Print page address
+				printf("   %016" PRIx64 "-%016" PRIx64, offset, offset + pagesize - 1);
+			}
+
+			if (present) {
+				// Page is present in RAM
+				// Page accessed since it was marked idle
+				if ((ctx->kpgot[idx] & (KPAGE_GOTIDLE | KPAGE_IDLE)) == KPAGE_GOTIDLE) stats->accessed += pagesize;
+			
+				// Get PFN
+				pfn = entry & PM_PFN;
+
+				// Record who maps the page
+				if (globals->xref != NULL && pfn != 0) xref_add(globals, ctx, pfn, offset);
+
+				// Node the page lives on
+				if (globals->numa && pfn != 0) {
+					node = pfn_node(globals, ctx, pfn);
+					if (node >= 0) stats->node[node] += pagesize;
+				}
+
+				if (textpage) {
+					// Print PFN
+					printf(", Present");
+
+					if (pfn != 0) {
+						printf(" (pfn %016" PRIx64 ")", pfn);
+					}
+
+					if (ctx->kpgot[idx] & KPAGE_IDLE) printf(", Idle");
+				}
+
+				lead = false;
+
+				// Get page reference count and flags if we can
+				gotpagecnt = (ctx->kpgot[idx] & KPAGE_GOTCOUNT) != 0;
+				pagecnt = ctx->kpcount[idx];
+
+				gotpageflags = (ctx->kpgot[idx] & KPAGE_GOTFLAGS) != 0;
+				pageflags = ctx->kpflags[idx];
+
+				// Print present marker
+				if(globals->map) {
+					// If swapped or SWAPCACHE print 'B'
+					if (swapped || (gotpageflags && (pageflags & (1 << 13)))) mappages(globals, 'B', 1);
+					else mappages(globals, 'P', 1);
+				}
+
+				if (shard != NULL && !shard->resolved) {
+					if (gotpageflags && (pageflags & (1 << 16))) {
+						// Leading compound tail in a shard, the head is resolved when shards are merged
+						lead = true;
+						++shard->leadpages;
+						if (gotpagecnt) ++shard->leadcnt;
+
+					} else {
+						shard->resolved = true;
+
+					}
+				}
+
+				pgstate = lead ? &shard->leadstate : state;
+				pgstats = lead ? &shard->leadown : stats;
+
+				if (gotpageflags) {
+					if (pageflags & (1 << 15)) {
+						// Compound head
+						pgstate->incompound = true;
+						pgstate->hdpageflags = pageflags;
+						pgstate->hdgotpagecnt = gotpagecnt;
+						pgstate->hdpagecnt = pagecnt;
+
+					} else if(pgstate->incompound && pageflags & (1 << 16)){
+						// Compound tail, use hdpageflags from header
+
+					} else {
+						// Not compound
+						pgstate->incompound = false;
+						pgstate->hdpageflags = pageflags;
+						pgstate->hdgotpagecnt = gotpagecnt;
+						pgstate->hdpagecnt = pagecnt;
+
+					}
+
+				} else {
+					// Page flags not available
+					pgstate->incompound = false;
+					pgstate->hdgotpagecnt = gotpagecnt;
+					pgstate->hdpagecnt = pagecnt;
+
+				}
+
+				if (gotpagecnt) {
+					if (textpage) {
+						// Print reference count
+						printf(", RefCnt %" PRIu64, pagecnt);
+					}
+
+					if (pgstate->hdgotpagecnt) {
+						// Accumulate private stats
+						if (pgstate->hdpagecnt <= 1) pgstats->priv += pagesize;
+						if (pgstate->hdpagecnt >= 1) pgstats->privavg += (pagesize << 8) / pgstate->hdpagecnt;
+					}
+				}
+
+				if (gotpageflags) {
+					if (textpage) {
+						// Print page flags
+						printf(", Flags ");
+						dumpflags(pageflags);
+					}
+
+					// Accumulate anonymous memory
+					if(pgstate->hdpageflags & (1 << 12)) pgstats->anon += pagesize;
+
+					// Accumulate referenced memory
+					if(pgstate->hdpageflags & (1 << 2)) pgstats->refd += pagesize;
+
+					// Accumulate huge pages
+					if(pgstate->hdpageflags & (1 << 17 | 1 << 22)) pgstats->huge += pagesize;
+				}
+
+			}
+
+			if (swapped) {
+				// Page is in swap space
+				if (!present && globals->map) mappages(globals, 'S', 1);
+
+				// Unpack swap file and offset
+				swapfile = entry & 0x000000000000001fLL;
+				swapoff = (entry & 0x007fffffffffffe0LL) >> 5;
+
+				if(textpage) {
+					// Print swap details
+					printf(", Swapped (seg %u offs %016" PRIx64 ")", (unsigned int) swapfile, swapoff);
+				}
+			}
+		
+			if (textpage) {
+				printf("\n");
+			}
+
+			if (globals->verbose && globals->format != OUT_TEXT) {
+				// Page record
+				dumppage(globals, ctx, idx, offset);
+			}
+		}
+
+		offset = base + entries * pagesize;
+
+		if (entries == 0) break;
+	}
+
+	return offset;
+}
+
+int scanshards(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+               bool pmscan, struct scanstate *state, struct sstats *stats)
+{
+	struct shardpool pool;
+	pthread_t *threads;
+	uint64_t boundary;
+	int nthreads;
+	int started = 0;
+	int loop;
+
+	// Split on SHARD_SIZE aligned boundaries
+	pool.nshards = 0;
+	for (boundary = start; boundary < end; boundary = (boundary / SHARD_SIZE + 1) * SHARD_SIZE) ++pool.nshards;
+
+	pool.shards = (struct shard *) calloc(pool.nshards, sizeof(struct shard));
+	threads = (pthread_t *) malloc(globals->jobs * sizeof(pthread_t));
+
+	if (pool.shards == NULL || threads == NULL) {
+		// Fall back to scanning serially
+		if (pool.shards != NULL) free(pool.shards);
+		if (threads != NULL) free(threads);
+		scanrange(globals, ctx, hpagemap, start, end, pmscan, state, stats, NULL);
+		return RET_NOMEM;
+	}
+
+	for (loop = 0, boundary = start; loop < pool.nshards; loop++) {
+		pool.shards[loop].start = boundary;
+		boundary = (boundary / SHARD_SIZE + 1) * SHARD_SIZE;
+		pool.shards[loop].end = (boundary < end ? boundary : end);
+	}
+
+	pool.globals = globals;
+	pool.hpagemap = hpagemap;
+	pool.pmscan = pmscan;
+	pool.nextshard = 0;
+	pool.prof = ctx->prof;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	// Start helper threads, this thread scans shards too
+	nthreads = globals->jobs - 1;
+	if (nthreads > pool.nshards - 1) nthreads = pool.nshards - 1;
+
+	for (loop = 0; loop < nthreads; loop++) {
+		if (pthread_create(&threads[started], NULL, scanshards_worker, &pool) == 0) ++started;
+	}
+
+	scanshards_run(&pool, ctx);
+
+	for (loop = 0; loop < started; loop++) {
+		pthread_join(threads[loop], NULL);
+	}
+
+	// Merge shard results in address order
+	for (loop = 0; loop < pool.nshards; loop++) {
+		mergeshard(&pool.shards[loop], state, stats);
+	}
+
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free(pool.shards);
+
+	return RET_OK;
+}
+
+void *scanshards_worker(void *arg)
+{
+	struct shardpool *pool = (struct shardpool *) arg;
+	struct scanctx *ctx;
+
+	ctx = scanctx_create(pool->globals);
+
+	if (ctx != NULL) {
+		scanshards_run(pool, ctx);
+
+		if (ctx->prof != NULL) {
+			// Add to the profile of the process being scanned
+			pthread_mutex_lock(&pool->lock);
+			prof_merge(pool->prof, ctx->prof);
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		scanctx_destroy(ctx);
+	}
+
+	return NULL;
+}
+
+void scanshards_run(struct shardpool *pool, struct scanctx *ctx)
+{
+	struct shard *shard;
+	int next;
+
+	while (1) {
+		// Take the next shard
+		pthread_mutex_lock(&pool->lock);
+		next = pool->nextshard++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (next >= pool->nshards) break;
+
+		shard = &pool->shards[next];
+		clearstats(&shard->stats);
+		clearstats(&shard->leadown);
+		clearstate(&shard->state);
+		clearstate(&shard->leadstate);
+
+		scanrange(pool->globals, ctx, pool->hpagemap, shard->start, shard->end, pool->pmscan,
+		          &shard->state, &shard->stats, shard);
+	}
+}
+
+void mergeshard(struct shard *shard, struct scanstate *state, struct sstats *stats)
+{
+	unsigned int pagesize = getpagesize();
+
+	if (shard->leadpages > 0) {
+		if (state->incompound) {
+			// Leading tails belong to the compound page open at the end of the previous shard
+			if (state->hdgotpagecnt) {
+				if (state->hdpagecnt <= 1) stats->priv += shard->leadcnt * pagesize;
+				if (state->hdpagecnt >= 1) stats->privavg += shard->leadcnt * ((pagesize << 8) / state->hdpagecnt);
+			}
+
+			if (state->hdpageflags & (1 << 12)) stats->anon += shard->leadpages * pagesize;
+			if (state->hdpageflags & (1 << 2)) stats->refd += shard->leadpages * pagesize;
+			if (state->hdpageflags & (1 << 17 | 1 << 22)) stats->huge += shard->leadpages * pagesize;
+
+		} else {
+			// No compound page open, leading tails stand alone
+			addstats(stats, &shard->leadown);
+			*state = shard->leadstate;
+
+		}
+	}
+
+	if (shard->resolved) *state = shard->state;
+
+	addstats(stats, &shard->stats);
+}
+
+void scanestimate(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start, uint64_t end,
+                  bool pmscan, struct scanstate *state, struct sstats *stats)
+{
+	struct sstats unit;
+	uint64_t pagesize = getpagesize();
+	uint64_t unitsize = EST_UNIT * pagesize;
+	uint64_t stratsize = unitsize * globals->eststride;
+	uint64_t from, to, first, last, pick;
+	uint64_t ustart, uend;
+	uint64_t strata = 0;
+	double values[EST_FIELDS];
+	double prev[EST_FIELDS];
+	double diffs[EST_FIELDS];
+	double scale;
+	int field;
+
+	if (end - start <= unitsize || (end - 1) / stratsize == start / stratsize) {
+		// Sections within one stratum are read in full, one unit can't give an interval
+		scanrange(globals, ctx, hpagemap, start, end, pmscan, state, stats, NULL);
+		return;
+	}
+
+	memset(diffs, 0, sizeof(diffs));
+
+	for (from = start; from < end; from = to) {
+		// Each stratum is a run of units on an aligned boundary
+		to = (from / stratsize + 1) * stratsize;
+		if (to > end) to = end;
+
+		// Read one unit of it picked at random
+		first = from / unitsize;
+		last = (to - 1) / unitsize;
+		pick = first + (uint64_t) rand_r(&ctx->estseed) % (last - first + 1);
+
+		ustart = (pick * unitsize > from ? pick * unitsize : from);
+		uend = ((pick + 1) * unitsize < to ? (pick + 1) * unitsize : to);
+
+		// Units aren't contiguous so compound pages can't carry over
+		clearstats(&unit);
+		clearstate(state);
+		scanrange(globals, ctx, hpagemap, ustart, uend, pmscan, state, &unit, NULL);
+
+		// Scale up to the whole stratum
+		scale = (double) (to - from) / (double) (uend - ustart);
+		addscaled(stats, &unit, scale);
+
+		values[EST_PRESENT] = unit.present * scale;
+		values[EST_PRIVATE] = unit.priv * scale;
+		values[EST_ANON] = unit.anon * scale;
+		values[EST_HUGE] = unit.huge * scale;
+		values[EST_SWAPPED] = unit.swapped * scale;
+
+		for (field = 0; field < EST_FIELDS; field++) {
+			if (strata > 0) diffs[field] += (values[field] - prev[field]) * (values[field] - prev[field]);
+			prev[field] = values[field];
+		}
+
+		++strata;
+	}
+
+	clearstate(state);
+
+	// Successive difference variance of the total, neighbouring strata being alike
+	for (field = 0; field < EST_FIELDS; field++) {
+		stats->var[field] += (1.0 - 1.0 / globals->eststride) * strata / (2.0 * (strata - 1)) * diffs[field];
+	}
+
+	stats->estimated = true;
+}
+
+void dumpstats(struct global *globals, struct sstats *stats)
+{
+	char name[16];
+	uint64_t bar;
+	int node;
+
+	if (globals->list) {
+		printf(" %8" PRIu64 " %8" PRIu64, stats->size / 1024, stats->present / 1024);
+		
+		if (globals->hkpagecount >= 0) {
+			printf(" %8" PRIu64 " %8" PRIu64, stats->priv / 1024, (stats->privavg >> 8) / 1024);
+		}
+		
+		if (globals->hkpageflags >= 0) {
+			printf(" %8" PRIu64 " %8" PRIu64 " %8" PRIu64, stats->anon / 1024, stats->refd / 1024, stats->huge / 1024);
+		}
+
+		for (node = 0; node < globals->nnodes; node++) printf(" %8" PRIu64, stats->node[node] / 1024);
+		
+		printf(" %8" PRIu64, stats->swapped / 1024);
+
+	} else{
+		printf("Size:       %8" PRIu64 " kB\n", stats->size / 1024);
+		printf("Present:    %8" PRIu64 " kB (%.1f%%)", stats->present / 1024, ((double) stats->present / (double) stats->size) * 100.0);
+		dumperror(stats, EST_PRESENT);
+		
+		if (globals->hkpagecount >= 0 && stats->present) {
+			printf("  Unique:   %8" PRIu64 " kB (%.1f%%)", stats->priv / 1024, ((double) stats->priv / (double) stats->present) * 100.0);
+			dumperror(stats, EST_PRIVATE);
+			printf("  Average:  %8" PRIu64 " kB (%.1f%%)\n", (stats->privavg >> 8) / 1024, ((double) (stats->privavg >> 8) / (double) stats->present) * 100.0);
+		}
+		
+		if (globals->hkpageflags >= 0 && stats->present) {
+			printf("  Anon:     %8" PRIu64 " kB (%.1f%%)", stats->anon / 1024, ((double) stats->anon / (double) stats->present) * 100.0);
+			dumperror(stats, EST_ANON);
+			printf("  Huge:     %8" PRIu64 " kB (%.1f%%)", stats->huge / 1024, ((double) stats->huge / (double) stats->present) * 100.0);
+			dumperror(stats, EST_HUGE);
+			printf("Referenced: %8" PRIu64 " kB (%.1f%%)\n", stats->refd / 1024, ((double) stats->refd / (double) stats->size) * 100.0);
+		}
+
+		if (globals->hpageidle >= 0 && stats->present) {
+			printf("Accessed:   %8" PRIu64 " kB (%.1f%%)\n", stats->accessed / 1024, ((double) stats->accessed / (double) stats->present) * 100.0);
+		}
+
+		if (stats->present) {
+			for (node = 0; node < globals->nnodes; node++) {
+				// Share of present memory on each node
+				sprintf(name, "  Node %d:", globals->nodeids[node]);
+				printf("%-12s%8" PRIu64 " kB (%5.1f%%) ", name, stats->node[node] / 1024, ((double) stats->node[node] / (double) stats->present) * 100.0);
+				for (bar = (stats->node[node] * 40 + stats->present / 2) / stats->present; bar > 0; bar--) putchar('#');
+				printf("\n");
+			}
+		}
+		
+		printf("Swapped:    %8" PRIu64 " kB (%.1f%%)", stats->swapped / 1024, ((double) stats->swapped / (double) stats->size) * 100.0);
+		dumperror(stats, EST_SWAPPED);
+
+	}
+	
+	clearstats(stats);
+}
+
+void dumperror(struct sstats *stats, int field)
+{
+	// Confidence interval of an estimated figure
+	if (stats->estimated) printf(" +/- %.0f kB", EST_Z * sqrt(stats->var[field]) / 1024);
+
+	printf("\n");
+}
+
+void dumpdelta(struct global *globals, struct sstats *stats, uint64_t key0, uint64_t key1)
+{
+	struct sample *prev;
+	struct sstats none;
+	struct sstats *old;
+	int64_t size, present, priv, privavg, anon, refd, swapped, huge;
+	int64_t nodes[MAX_NODES];
+	char name[16];
+	int node;
+
+	// Print absolute values the first time round
+	if (globals->iteration == 0) {
+		sample_add(globals, key0, key1, stats);
+		dumpstats(globals, stats);
+		return;
+	}
+
+	// Compare with the last interval, anything new starts from zero
+	prev = sample_find(globals, key0, key1);
+
+	if (prev != NULL) {
+		old = &prev->stats;
+	} else {
+		clearstats(&none);
+		old = &none;
+	}
+
+	sample_add(globals, key0, key1, stats);
+
+	size = (int64_t) (stats->size / 1024) - (int64_t) (old->size / 1024);
+	present = (int64_t) (stats->present / 1024) - (int64_t) (old->present / 1024);
+	priv = (int64_t) (stats->priv / 1024) - (int64_t) (old->priv / 1024);
+	privavg = (int64_t) ((stats->privavg >> 8) / 1024) - (int64_t) ((old->privavg >> 8) / 1024);
+	anon = (int64_t) (stats->anon / 1024) - (int64_t) (old->anon / 1024);
+	refd = (int64_t) (stats->refd / 1024) - (int64_t) (old->refd / 1024);
+	swapped = (int64_t) (stats->swapped / 1024) - (int64_t) (old->swapped / 1024);
+	huge = (int64_t) (stats->huge / 1024) - (int64_t) (old->huge / 1024);
+
+	for (node = 0; node < globals->nnodes; node++) {
+		nodes[node] = (int64_t) (stats->node[node] / 1024) - (int64_t) (old->node[node] / 1024);
+	}
+
+	if (globals->list) {
+		printf(" %+8" PRId64 " %+8" PRId64, size, present);
+		
+		if (globals->hkpagecount >= 0) {
+			printf(" %+8" PRId64 " %+8" PRId64, priv, privavg);
+		}
+		
+		if (globals->hkpageflags >= 0) {
+			printf(" %+8" PRId64 " %+8" PRId64 " %+8" PRId64, anon, refd, huge);
+		}
+
+		for (node = 0; node < globals->nnodes; node++) printf(" %+8" PRId64, nodes[node]);
+		
+		printf(" %+8" PRId64, swapped);
+
+	} else{
+		printf("Size:       %+8" PRId64 " kB\n", size);
+		printf("Present:    %+8" PRId64 " kB\n", present);
+		
+		if (globals->hkpagecount >= 0) {
+			printf("  Unique:   %+8" PRId64 " kB\n", priv);
+			printf("  Average:  %+8" PRId64 " kB\n", privavg);
+		}
+		
+		if (globals->hkpageflags >= 0) {
+			printf("  Anon:     %+8" PRId64 " kB\n", anon);
+			printf("  Huge:     %+8" PRId64 " kB\n", huge);
+			printf("Referenced: %+8" PRId64 " kB\n", refd);
+		}
+
+		for (node = 0; node < globals->nnodes; node++) {
+			sprintf(name, "  Node %d:", globals->nodeids[node]);
+			printf("%-12s%+8" PRId64 " kB\n", name, nodes[node]);
+		}
+		
+		printf("Swapped:    %+8" PRId64 " kB\n", swapped);
+
+	}
+
+	clearstats(stats);
+}
+
+void dumprecord(struct global *globals, int rectype, uint64_t pid, uint64_t tid, struct vmainfo *vma,
+                struct sstats *stats, const char *cmdline)
+{
+	char nodes[MAX_NODES * 32];
+	int node;
+	int len;
+
+	out_begin(globals, rectype);
+
+	if (globals->interval != 0) out_num(globals, FLD_ITERATION, globals->iteration);
+	out_num(globals, FLD_PID, pid);
+	if (tid != 0) out_num(globals, FLD_TID, tid);
+
+	if (vma != NULL) {
+		out_num(globals, FLD_START, vma->start);
+		out_num(globals, FLD_END, vma->end);
+		out_text(globals, FLD_PERMS, vma->perms);
+		out_text(globals, FLD_NAME, vma->name);
+	}
+
+	out_num(globals, FLD_SIZE, stats->size);
+	out_num(globals, FLD_PRESENT, stats->present);
+
+	if (globals->hkpagecount >= 0) {
+		out_num(globals, FLD_UNIQUE, stats->priv);
+		out_num(globals, FLD_AVERAGE, stats->privavg >> 8);
+	}
+
+	if (globals->hkpageflags >= 0) {
+		out_num(globals, FLD_ANON, stats->anon);
+		out_num(globals, FLD_REFERENCED, stats->refd);
+		out_num(globals, FLD_HUGE, stats->huge);
+	}
+
+	out_num(globals, FLD_SWAPPED, stats->swapped);
+	if (globals->hpageidle >= 0) out_num(globals, FLD_ACCESSED, stats->accessed);
+
+	if (cmdline != NULL) out_text(globals, FLD_CMDLINE, cmdline);
+
+	if (globals->nnodes > 0) {
+		// Node and bytes pairs
+		for (node = 0, len = 0; node < globals->nnodes; node++) {
+			len += sprintf(nodes + len, "%s%d:%" PRIu64, node == 0 ? "" : " ", globals->nodeids[node], stats->node[node]);
+		}
+
+		out_text(globals, FLD_NODES, nodes);
+	}
+
+	out_end(globals);
+
+	clearstats(stats);
+}
+
+void dumppage(struct global *globals, struct scanctx *ctx, uint64_t idx, uint64_t offset)
+{
+	uint64_t entry = ctx->pmbuf[idx];
+	unsigned int pagesize = getpagesize();
+
+	out_begin(globals, REC_PAGE);
+
+	out_num(globals, FLD_SIZE, pagesize);
+	out_num(globals, FLD_PRESENT, (entry & PM_PRESENT) ? pagesize : 0);
+	out_num(globals, FLD_SWAPPED, (entry & PM_SWAPPED) ? pagesize : 0);
+
+	if (ctx->kpgot[idx] & KPAGE_GOTIDLE) {
+		out_num(globals, FLD_ACCESSED, (ctx->kpgot[idx] & KPAGE_IDLE) ? 0 : pagesize);
+	}
+
+	out_num(globals, FLD_ADDR, offset);
+
+	if (entry & PM_PRESENT) {
+		if ((entry & PM_PFN) != 0) out_num(globals, FLD_PFN, entry & PM_PFN);
+		if (ctx->kpgot[idx] & KPAGE_GOTCOUNT) out_num(globals, FLD_REFCNT, ctx->kpcount[idx]);
+		if (ctx->kpgot[idx] & KPAGE_GOTFLAGS) out_num(globals, FLD_FLAGS, ctx->kpflags[idx]);
+
+	} else if (entry & PM_SWAPPED) {
+		out_num(globals, FLD_SWAPFILE, entry & 0x000000000000001fLL);
+		out_num(globals, FLD_SWAPOFFSET, (entry & 0x007fffffffffffe0LL) >> 5);
+
+	}
+
+	out_end(globals);
+}
+
+const char *out_recnames[] = {
+	NULL, "process", "section", "totals", "page"
+};
+
+// Taken from Linux/include/uapi/linux/kernel-page-flags.h (0-26) and
+// Linux/include/linux/kernel-page-flags.h (32-40, subject to change)
+const char *kpageflag_names[64] = {
+	"LOCKED", "ERROR", "REFERENCED", "UPTODATE", "DIRTY", "LRU", "ACTIVE", "SLAB",
+	"WRITEBACK", "RECLAIM", "BUDDY", "MMAP", "ANON", "SWAPCACHE", "SWAPBACKED", "COMPHEAD",
+	"COMPTAIL", "HUGE", "UNEVICTABLE", "HWPOISON", "NOPAGE", "KSM", "THP", "BALLOON",
+	"ZERO_PAGE", "IDLE", "PGTABLE", NULL, NULL, NULL, NULL, NULL,
+	"RESERVED?", "MLOCKED?", "MAPPEDTODISK?", "PRIVATE?", "PRIVATE_2?", "OWNER_PRIVATE?", "ARCH?", "UNCACHED?",
+	"SOFTDIRTY?"
+};
+
+const char *out_fieldnames[FLD_COUNT] = {
+	NULL, "iteration", "pid", "tid", "start", "end", "perms", "name", "size", "present", "unique", "average",
+	"anon", "referenced", "huge", "swapped", "accessed", "addr", "pfn", "refcnt", "flags", "swapfile",
+	"swapoffset", "cmdline", "nodes"
+};
+
+void out_header(struct global *globals)
+{
+	int field;
+
+	switch (globals->format) {
+	case OUT_CSV:
+		// Column names
+		out_write(globals, "type", 4);
+
+		for (field = 1; field < FLD_COUNT; field++) {
+			out_write(globals, ",", 1);
+			out_write(globals, out_fieldnames[field], strlen(out_fieldnames[field]));
+		}
+
+		out_write(globals, "\n", 1);
+		break;
+
+	case OUT_BIN:
+		// Stream signature. Each record is a type byte followed by fields, each a field
+		// number byte and a host order 64-bit value, or for text fields a host order
+		// 16-bit length and the bytes. A zero field number ends the record
+		out_write(globals, OUTBIN_MAGIC, 8);
+		break;
+
+	}
+}
+
+void out_begin(struct global *globals, int rectype)
+{
+	uint8_t type = rectype;
+
+	globals->outcol = 0;
+
+	switch (globals->format) {
+	case OUT_JSON:
+		out_write(globals, "{\"type\":\"", 9);
+		out_write(globals, out_recnames[rectype], strlen(out_recnames[rectype]));
+		out_write(globals, "\"", 1);
+		break;
+
+	case OUT_CSV:
+		out_write(globals, out_recnames[rectype], strlen(out_recnames[rectype]));
+		break;
+
+	case OUT_BIN:
+		out_write(globals, &type, 1);
+		break;
+
+	}
+}
+
+void out_field(struct global *globals, int field)
+{
+	uint8_t id = field;
+
+	switch (globals->format) {
+	case OUT_JSON:
+		out_write(globals, ",\"", 2);
+		out_write(globals, out_fieldnames[field], strlen(out_fieldnames[field]));
+		out_write(globals, "\":", 2);
+		break;
+
+	case OUT_CSV:
+		// Fill in skipped columns
+		for (; globals->outcol < field; globals->outcol++) out_write(globals, ",", 1);
+		break;
+
+	case OUT_BIN:
+		out_write(globals, &id, 1);
+		break;
+
+	}
+}
+
+void out_num(struct global *globals, int field, uint64_t value)
+{
+	char digits[20];
+	int pos = sizeof(digits);
+
+	out_field(globals, field);
+
+	if (globals->format == OUT_BIN) {
+		out_write(globals, &value, sizeof(value));
+		return;
+	}
+
+	// Format decimal digits backwards
+	do {
+		digits[--pos] = '0' + (value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	out_write(globals, digits + pos, sizeof(digits) - pos);
+}
+
+void out_text(struct global *globals, int field, const char *value)
+{
+	const char *run;
+	char esc[8];
+	uint16_t len;
+
+	out_field(globals, field);
+
+	switch (globals->format) {
+	case OUT_JSON:
+		out_write(globals, "\"", 1);
+
+		for (run = value; *value != '\x0'; value++) {
+			if (*value != '"' && *value != '\\' && (unsigned char) *value >= 0x20) continue;
+
+			// Escape the character after writing the run before it
+			out_write(globals, run, value - run);
+			if (*value == '"' || *value == '\\') sprintf(esc, "\\%c", *value);
+			else sprintf(esc, "\\u%04x", (unsigned char) *value);
+			out_write(globals, esc, strlen(esc));
+			run = value + 1;
+		}
+
+		out_write(globals, run, value - run);
+		out_write(globals, "\"", 1);
+		break;
+
+	case OUT_CSV:
+		out_write(globals, "\"", 1);
+
+		for (run = value; *value != '\x0'; value++) {
+			if (*value != '"') continue;
+
+			// Double quotes
+			out_write(globals, run, value - run + 1);
+			run = value;
+		}
+
+		out_write(globals, run, value - run);
+		out_write(globals, "\"", 1);
+		break;
+
+	case OUT_BIN:
+		len = (strlen(value) > UINT16_MAX ? UINT16_MAX : strlen(value));
+		out_write(globals, &len, sizeof(len));
+		out_write(globals, value, len);
+		break;
+
+	}
+}
+
+void out_end(struct global *globals)
+{
+	uint8_t id = 0;
+
+	switch (globals->format) {
+	case OUT_JSON:
+		out_write(globals, "}\n", 2);
+		break;
+
+	case OUT_CSV:
+		out_field(globals, FLD_COUNT - 1);
+		out_write(globals, "\n", 1);
+		break;
+
+	case OUT_BIN:
+		out_write(globals, &id, 1);
+		break;
+
+	}
+}
+
+void out_write(struct global *globals, const void *data, size_t len)
+{
+	size_t chunk;
+
+	while (len > 0) {
+		if (globals->outlen == OUTBUF_SIZE) out_flush(globals);
+
+		// Copy as much as fits in the buffer
+		chunk = OUTBUF_SIZE - globals->outlen;
+		if (chunk > len) chunk = len;
+
+		memcpy(globals->outbuf + globals->outlen, data, chunk);
+		globals->outlen += chunk;
+		data = (const char *) data + chunk;
+		len -= chunk;
+	}
+}
+
+void out_flush(struct global *globals)
+{
+	size_t done = 0;
+	ssize_t b;
+
+	while (done < globals->outlen) {
+		b = write(fileno(stdout), globals->outbuf + done, globals->outlen - done);
+		if (b <= 0) break;
+		done += b;
+	}
+
+	globals->outlen = 0;
+}
+
+void sample_add(struct global *globals, uint64_t key0, uint64_t key1, struct sstats *stats)
+{
+	struct sample *samples;
+	uint64_t maxcur;
+
+	if (globals->ncur == globals->maxcur) {
+		// Grow the sample array
+		maxcur = (globals->maxcur ? globals->maxcur * 2 : 256);
+		samples = (struct sample *) realloc(globals->cur, maxcur * sizeof(struct sample));
+		if (samples == NULL) return;
+
+		globals->cur = samples;
+		globals->maxcur = maxcur;
+	}
+
+	globals->cur[globals->ncur].key[0] = key0;
+	globals->cur[globals->ncur].key[1] = key1;
+	globals->cur[globals->ncur].stats = *stats;
+	++globals->ncur;
+}
+
+int sample_cmp(const void *one, const void *two)
+{
+	const struct sample *sone = (const struct sample *) one;
+	const struct sample *stwo = (const struct sample *) two;
+
+	if (sone->key[0] != stwo->key[0]) return (sone->key[0] < stwo->key[0] ? -1 : 1);
+	if (sone->key[1] != stwo->key[1]) return (sone->key[1] < stwo->key[1] ? -1 : 1);
+
+	return 0;
+}
+
+struct sample *sample_find(struct global *globals, uint64_t key0, uint64_t key1)
+{
+	struct sample key;
+
+	// Samples are added in key order
+	key.key[0] = key0;
+	key.key[1] = key1;
+
+	if (globals->prev == NULL) return NULL;
+
+	return (struct sample *) bsearch(&key, globals->prev, globals->nprev, sizeof(struct sample), sample_cmp);
+}
+
+void sample_next(struct global *globals)
+{
+	struct sample *samples;
+	uint64_t maxsamples;
+
+	// Current samples become the previous ones, reusing the old array
+	samples = globals->prev;
+	maxsamples = globals->maxprev;
+
+	globals->prev = globals->cur;
+	globals->nprev = globals->ncur;
+	globals->maxprev = globals->maxcur;
+
+	globals->cur = samples;
+	globals->ncur = 0;
+	globals->maxcur = maxsamples;
+}
+
+void waitinterval(struct global *globals, struct timespec *next)
+{
+	// Sleep until the next interval boundary
+	next->tv_sec += globals->interval;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR);
+}
+
+void addstats(struct sstats *stats, struct sstats *add)
+{
+	int loop;
+
+	stats->size += add->size;
+	stats->present += add->present;
+	stats->priv += add->priv;
+	stats->privavg += add->privavg;
+	stats->anon += add->anon;
+	stats->refd += add->refd;
+	stats->swapped += add->swapped;
+	stats->huge += add->huge;
+	stats->accessed += add->accessed;
+	for (loop = 0; loop < MAX_NODES; loop++) stats->node[loop] += add->node[loop];
+
+	stats->estimated |= add->estimated;
+	for (loop = 0; loop < EST_FIELDS; loop++) stats->var[loop] += add->var[loop];
+}
+
+void addscaled(struct sstats *stats, struct sstats *add, double scale)
+{
+	int loop;
+
+	// Sizes come from the maps so stay exact
+	stats->present += (uint64_t) (add->present * scale + 0.5);
+	stats->priv += (uint64_t) (add->priv * scale + 0.5);
+	stats->privavg += (uint64_t) (add->privavg * scale + 0.5);
+	stats->anon += (uint64_t) (add->anon * scale + 0.5);
+	stats->refd += (uint64_t) (add->refd * scale + 0.5);
+	stats->swapped += (uint64_t) (add->swapped * scale + 0.5);
+	stats->huge += (uint64_t) (add->huge * scale + 0.5);
+	stats->accessed += (uint64_t) (add->accessed * scale + 0.5);
+	for (loop = 0; loop < MAX_NODES; loop++) stats->node[loop] += (uint64_t) (add->node[loop] * scale + 0.5);
+}
+
+void clearstate(struct scanstate *state)
+{
+	state->incompound = false;
+	state->hdgotpagecnt = false;
+	state->hdpagecnt = 0;
+	state->hdpageflags = 0;
+}
+
+void clearstats(struct sstats *stats)
+{
+	stats->size = 0;
+	stats->present = 0;
+	stats->priv = 0;
+	stats->privavg = 0;
+	stats->anon = 0;
+	stats->refd = 0;
+	stats->swapped = 0;
+	stats->huge = 0;
+	stats->accessed = 0;
+	memset(stats->node, 0, sizeof(stats->node));
+	stats->estimated = false;
+	memset(stats->var, 0, sizeof(stats->var));
+}
+
+void printsize(uint64_t size)
+{
+	int mult = 0;
+	const char *unit;
+	
+	while (size > (mult == 0 ? 1024 : 8192)) {
+		size /= 1024;
+		++mult;	
+	}
+
+	switch(mult){
+	case 0:
+		unit="B";
+		break;
+	case 1:
+		unit="kB";
+		break;
+	case 2:
+		unit="MB";
+		break;
+	case 3:
+		unit="GB";
+		break;
+	case 4:
+		unit="TB";
+		break;
+	case 5:
+		unit="PB";
+		break;
+	case 6:
+		unit="EB";
+		break;
+	default:
+		unit="??";
+		break;
+	}
+	
+	printf("[%4" PRIu64 " %2s]",size,unit);
+}
+
+void dumpflags(uint64_t flags)
+{
+	int loop;
+	int first=1;
+	
+	for (loop = 0; loop < 64; loop++) {
+		if (flags & 1) {
+			if(first){
+				printf("[");
+				first = 0;
+			} else{
+				printf(" ");
+			}
+			
+			if (kpageflag_names[loop] != NULL) printf("%s", kpageflag_names[loop]);
+			else printf("<%d>",loop);
+		}
+
+		flags >>= 1;
+	}
+
+	if (first) printf("[]");
+	else printf("]");
+}
+
+bool pmscan_probe()
+{
+	struct pm_scan_arg arg;
+	struct page_region region;
+	int hpagemap;
+	int result;
+
+	hpagemap = open("/proc/self/pagemap", O_RDONLY);
+	if (hpagemap < 0) return false;
+
+	// Scan the page holding the region buffer
+	memset(&arg, 0, sizeof(arg));
+	arg.size = sizeof(arg);
+	arg.start = (uintptr_t) &region & ~((uintptr_t) getpagesize() - 1);
+	arg.end = arg.start + getpagesize();
+	arg.vec = (uintptr_t) &region;
+	arg.vec_len = 1;
+	arg.category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+	arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+
+	result = ioctl(hpagemap, PAGEMAP_SCAN, &arg);
+
+	close(hpagemap);
+
+	return result >= 0;
+}
+
+bool pmscan_skipped(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t start)
+{
+	// PAGEMAP_SCAN skips PFN mapped sections, which page map entries report as present
+	if (readpagemap(globals, ctx, hpagemap, ctx->pmbuf, 1, start / getpagesize()) != sizeof(uint64_t)) return false;
+
+	return (ctx->pmbuf[0] & PM_PRESENT) != 0;
+}
+
+void mapstart(struct global *globals, uint64_t pages)
+{
+	// Choose the pages per cell for the section
+	if (globals->mapgran != 0) globals->mapcell = globals->mapgran;
+	else if (globals->terminal && globals->termwidth > 0) globals->mapcell = (pages + globals->termwidth - 1) / globals->termwidth;
+	else globals->mapcell = 1;
+
+	if (globals->mapcell == 0) globals->mapcell = 1;
+
+	globals->mapfill = 0;
+	globals->mappresent = 0;
+	globals->mapswapped = 0;
+	globals->mapboth = 0;
+	globals->maplen = 0;
+
+	if (globals->mapcell > 1) {
+		printf("Cell:       ");
+		printsize(globals->mapcell * getpagesize());
+		printf("\n");
+	}
+}
+
+void mappages(struct global *globals, char ch, uint64_t count)
+{
+	uint64_t cells;
+	uint64_t chunk;
+
+	while (count > 0) {
+		if (globals->mapfill == 0 && count >= globals->mapcell) {
+			// Run covers whole cells
+			cells = count / globals->mapcell;
+			mapemit(globals, ch, cells);
+			count -= cells * globals->mapcell;
+			continue;
+		}
+
+		// Add to the current cell
+		chunk = globals->mapcell - globals->mapfill;
+		if (chunk > count) chunk = count;
+
+		switch (ch) {
+		case 'P':
+			globals->mappresent += chunk;
+			break;
+
+		case 'S':
+			globals->mapswapped += chunk;
+			break;
+
+		case 'B':
+			globals->mapboth += chunk;
+			break;
+
+		}
+
+		globals->mapfill += chunk;
+		count -= chunk;
+
+		if (globals->mapfill == globals->mapcell) mapcellend(globals);
+	}
+}
+
+void mapcellend(struct global *globals)
+{
+	char ch;
+	bool full;
+
+	full = (globals->mappresent + globals->mapswapped + globals->mapboth == globals->mapfill);
+
+	if (globals->mappresent + globals->mapswapped + globals->mapboth == 0) ch = '.';
+	else if (globals->mapswapped + globals->mapboth == 0) ch = (full ? 'P' : 'p');
+	else if (globals->mappresent + globals->mapboth == 0) ch = (full ? 'S' : 's');
+	else ch = (full ? 'B' : 'b');
+
+	mapemit(globals, ch, 1);
+
+	globals->mapfill = 0;
+	globals->mappresent = 0;
+	globals->mapswapped = 0;
+	globals->mapboth = 0;
+}
+
+void mapemit(struct global *globals, char ch, uint64_t count)
+{
+	uint64_t chunk;
+
+	while (count > 0) {
+		if (globals->maplen == MAPBUF_SIZE) {
+			fwrite(globals->mapbuf, 1, globals->maplen, stdout);
+			globals->maplen = 0;
+		}
+
+		chunk = MAPBUF_SIZE - globals->maplen;
+		if (chunk > count) chunk = count;
+
+		memset(globals->mapbuf + globals->maplen, ch, chunk);
+		globals->maplen += chunk;
+		count -= chunk;
+	}
+}
+
+void mapend(struct global *globals)
+{
+	// Finish a partial last cell
+	if (globals->mapfill > 0) mapcellend(globals);
+
+	mapemit(globals, '\n', 1);
+	fwrite(globals->mapbuf, 1, globals->maplen, stdout);
+	globals->maplen = 0;
+}
+
+void flushnp(struct global *globals, uint64_t *npstart, uint64_t offset)
+{
+	if (*npstart != UINT64_MAX) {
+		if (globals->verbose && globals->format == OUT_TEXT) {
+			printf("   %016" PRIx64 "-%016" PRIx64, *npstart, offset - 1);
+			printf(", Not present ");
+			printsize(offset - *npstart);
+			printf("\n");
+		}
+
+		*npstart = UINT64_MAX;
+	}
+}
+
+int kpagereq_cmp(const void *one, const void *two)
+{
+	uint64_t pfnone = ((const struct kpagereq *) one)->pfn;
+	uint64_t pfntwo = ((const struct kpagereq *) two)->pfn;
+
+	if (pfnone < pfntwo) return -1;
+	if (pfnone == pfntwo) return 0;
+
+	return 1;
+}
+
+void lookupkpages(struct global *globals, struct scanctx *ctx, uint64_t entries, uint64_t start, int huge)
+{
+	uint64_t loop;
+	uint64_t idx;
+	uint64_t nreq = 0;
+	uint64_t first;
+	uint64_t last;
+	uint64_t startpfn;
+	uint64_t endpfn;
+	uint64_t got;
+	uint64_t pfn;
+	uint64_t addr;
+	uint8_t allgot = 0;
+
+	if (globals->hkpagecount < 0 && globals->hkpageflags < 0 && globals->hpageidle < 0) return;
+
+	if (globals->hkpagecount >= 0) allgot |= KPAGE_GOTCOUNT;
+	if (globals->hkpageflags >= 0) allgot |= KPAGE_GOTFLAGS;
+
+	// Per page details are printed in verbose mode, huge pages need flags to find heads and tails
+	if (globals->verbose || globals->hkpageflags < 0 || globals->nhugesizes == 0) huge = HUGE_NONE;
+
+	memset(ctx->kpgot, 0, entries);
+
+	for (loop = 0; loop < ctx->ndata && huge != HUGE_NONE; loop++) {
+		idx = ctx->pmdata[loop];
+
+		if (ctx->pmbuf[idx] & PM_PRESENT) {
+			pfn = ctx->pmbuf[idx] & PM_PFN;
+			addr = start + idx * getpagesize();
+
+			if (hugepage(globals, ctx, addr, pfn, huge == HUGE_REGION || hugerun(globals, ctx, idx, entries, addr))) {
+				// Part of a huge page, the tails share the head's details
+				ctx->kpcount[idx] = ctx->hunit.count;
+				if (pfn == ctx->hunit.pfn) ctx->kpflags[idx] = ctx->hunit.flags;
+				else ctx->kpflags[idx] = (ctx->hunit.flags & ~(1ULL << 15)) | (1ULL << 16);
+				ctx->kpgot[idx] = ctx->hunit.got;
+			}
+		}
+	}
+
+	// Gather PFNs of present pages in the block
+	if (globals->kcache != NULL) pthread_mutex_lock(&globals->kcache->lock);
+
+	for (loop = 0; loop < ctx->ndata; loop++) {
+		idx = ctx->pmdata[loop];
+
+		if ((ctx->pmbuf[idx] & PM_PRESENT) && ctx->kpgot[idx] == 0) {
+			pfn = ctx->pmbuf[idx] & PM_PFN;
+
+			if (globals->kcache != NULL && kcache_get(globals->kcache, pfn, &ctx->kpcount[idx], &ctx->kpflags[idx])) {
+				// Already seen this page
+				ctx->kpgot[idx] = allgot;
+				continue;
+			}
+
+			ctx->kpreq[nreq].pfn = pfn;
+			ctx->kpreq[nreq].idx = idx;
+			++nreq;
+		}
+	}
+
+	if (globals->kcache != NULL) pthread_mutex_unlock(&globals->kcache->lock);
+
+	// Sort into PFN order
+	qsort(ctx->kpreq, nreq, sizeof(struct kpagereq), kpagereq_cmp);
+
+	for (first = 0; first < nreq; first = last + 1) {
+		// Extend the run over duplicate, adjacent and nearby PFNs
+		last = kpagerun(globals, ctx, first, nreq);
+		startpfn = ctx->kpreq[first].pfn;
+		endpfn = ctx->kpreq[last].pfn;
+
+		if (globals->hkpagecount >= 0) {
+			// Read page reference counts for the run and scatter back to the pages
+			readkpages(globals, ctx, KPAGE_GOTCOUNT, startpfn, endpfn - startpfn + 1, ctx->kprun, &got);
+
+			for (idx = first; idx <= last; idx++) {
+				if (ctx->kpreq[idx].pfn - startpfn < got && ctx->kprun[ctx->kpreq[idx].pfn - startpfn] != KPAGE_NONE) {
+					ctx->kpcount[ctx->kpreq[idx].idx] = ctx->kprun[ctx->kpreq[idx].pfn - startpfn];
+					ctx->kpgot[ctx->kpreq[idx].idx] |= KPAGE_GOTCOUNT;
+				}
+			}
+		}
+
+		if (globals->hkpageflags >= 0) {
+			// Read page flags for the run and scatter back to the pages
+			readkpages(globals, ctx, KPAGE_GOTFLAGS, startpfn, endpfn - startpfn + 1, ctx->kprun, &got);
+
+			for (idx = first; idx <= last; idx++) {
+				if (ctx->kpreq[idx].pfn - startpfn < got && ctx->kprun[ctx->kpreq[idx].pfn - startpfn] != KPAGE_NONE) {
+					ctx->kpflags[ctx->kpreq[idx].idx] = ctx->kprun[ctx->kpreq[idx].pfn - startpfn];
+					ctx->kpgot[ctx->kpreq[idx].idx] |= KPAGE_GOTFLAGS;
+				}
+			}
+		}
+
+		if (globals->hpageidle >= 0) {
+			// Read the idle bitmap words covering the run and scatter back to the pages
+			readkpages(globals, ctx, KPAGE_GOTIDLE, startpfn / 64, endpfn / 64 - startpfn / 64 + 1, ctx->kpidle, &got);
+
+			for (idx = first; idx <= last; idx++) {
+				pfn = ctx->kpreq[idx].pfn;
+
+				if (pfn / 64 - startpfn / 64 < got) {
+					ctx->kpgot[ctx->kpreq[idx].idx] |= KPAGE_GOTIDLE;
+					if (ctx->kpidle[pfn / 64 - startpfn / 64] & (1ULL << (pfn % 64))) ctx->kpgot[ctx->kpreq[idx].idx] |= KPAGE_IDLE;
+				}
+			}
+		}
+
+		if (globals->kcache != NULL) {
+			// Remember shared pages, private ones won't be looked up by another process
+			pthread_mutex_lock(&globals->kcache->lock);
+
+			for (idx = first; idx <= last; idx++) {
+				uint64_t pgidx = ctx->kpreq[idx].idx;
+
+				if (ctx->kpgot[pgidx] != allgot) continue;
+				if ((allgot & KPAGE_GOTCOUNT) && ctx->kpcount[pgidx] <= 1) continue;
+
+				kcache_put(globals->kcache, ctx->kpreq[idx].pfn, ctx->kpcount[pgidx], ctx->kpflags[pgidx]);
+			}
+
+			pthread_mutex_unlock(&globals->kcache->lock);
+		}
+	}
+}
+
+bool hugerun(struct global *globals, struct scanctx *ctx, uint64_t idx, uint64_t entries, uint64_t addr)
+{
+	uint64_t pages = globals->hugesizes[globals->nhugesizes - 1];
+	uint64_t pfn = ctx->pmbuf[idx] & PM_PFN;
+	uint64_t loop;
+
+	// A head is aligned in both address and PFN to the smallest huge page size
+	if ((addr / getpagesize()) % pages != 0 || pfn % pages != 0) return false;
+
+	// and the rest of the block maps the pages after it to the following PFNs
+	for (loop = 1; loop < pages && idx + loop < entries; loop++) {
+		if (!(ctx->pmbuf[idx + loop] & PM_PRESENT) || (ctx->pmbuf[idx + loop] & PM_PFN) != pfn + loop) return false;
+	}
+
+	return true;
+}
+
+bool hugepage(struct global *globals, struct scanctx *ctx, uint64_t addr, uint64_t pfn, bool probe)
+{
+	struct hugeunit *unit = &ctx->hunit;
+	unsigned int pagesize = getpagesize();
+	int loop;
+
+	// Still in the last huge page
+	if (unit->pages != 0 && addr >= unit->addr && addr < unit->addr + unit->pages * pagesize &&
+	    pfn == unit->pfn + (addr - unit->addr) / pagesize) return true;
+
+	if (!probe || pfn == 0) return false;
+
+	// Try sizes the address and PFN are both aligned to, largest first
+	for (loop = 0; loop < globals->nhugesizes; loop++) {
+		if ((addr / pagesize) % globals->hugesizes[loop] != 0) continue;
+		if (pfn % globals->hugesizes[loop] != 0) continue;
+
+		if (hugeprobe(globals, ctx, addr, pfn, globals->hugesizes[loop])) return true;
+	}
+
+	return false;
+}
+
+bool hugeprobe(struct global *globals, struct scanctx *ctx, uint64_t addr, uint64_t pfn, uint64_t pages)
+{
+	struct hugeunit *unit = &ctx->hunit;
+	uint64_t flags;
+	uint64_t tail;
+	uint64_t value;
+	uint64_t got;
+
+	// Must be a huge compound head
+	readkpages(globals, ctx, KPAGE_GOTFLAGS, pfn, 1, &flags, &got);
+	if (got == 0 || !(flags & (1 << 15)) || !(flags & (1 << 17 | 1 << 22))) return false;
+
+	// A smaller huge page would have another head after the first one
+	if (pages > globals->hugesizes[globals->nhugesizes - 1]) {
+		readkpages(globals, ctx, KPAGE_GOTFLAGS, pfn + globals->hugesizes[globals->nhugesizes - 1], 1, &tail, &got);
+		if (got == 0 || !(tail & (1 << 16))) return false;
+	}
+
+	// Last page must be a tail
+	readkpages(globals, ctx, KPAGE_GOTFLAGS, pfn + pages - 1, 1, &tail, &got);
+	if (got == 0 || !(tail & (1 << 16))) return false;
+
+	unit->addr = addr;
+	unit->pages = pages;
+	unit->pfn = pfn;
+	unit->flags = flags;
+	unit->count = 0;
+	unit->got = KPAGE_GOTFLAGS;
+
+	if (globals->hkpagecount >= 0) {
+		// Head reference count
+		readkpages(globals, ctx, KPAGE_GOTCOUNT, pfn, 1, &unit->count, &got);
+		if (got != 0) unit->got |= KPAGE_GOTCOUNT;
+	}
+
+	if (globals->hpageidle >= 0) {
+		// Idle bit of the head covers the whole page
+		readkpages(globals, ctx, KPAGE_GOTIDLE, pfn / 64, 1, &value, &got);
+		if (got != 0) unit->got |= KPAGE_GOTIDLE | ((value & (1ULL << (pfn % 64))) ? KPAGE_IDLE : 0);
+	}
+
+	return true;
+}
+
+int hugesizes_cmp(const void *one, const void *two)
+{
+	uint64_t size1 = *((const uint64_t *) one);
+	uint64_t size2 = *((const uint64_t *) two);
+
+	if (size1 > size2) return -1;
+	if (size1 < size2) return 1;
+	return 0;
+}
+
+void hugesizes_probe(struct global *globals)
+{
+	FILE *hfile;
+	DIR *hdir;
+	struct dirent *entry;
+	uint64_t size;
+	uint64_t pages[MAX_HUGESIZES];
+	int npages = 0;
+	int loop;
+
+	// PMD mapped transparent huge pages
+	hfile = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+
+	if (hfile != NULL) {
+		if (fscanf(hfile, "%" SCNu64, &size) == 1 && size / getpagesize() > 1) pages[npages++] = size / getpagesize();
+		fclose(hfile);
+	}
+
+	// Hugetlb page sizes
+	hdir = opendir("/sys/kernel/mm/hugepages");
+
+	if (hdir != NULL) {
+		while ((entry = readdir(hdir)) != NULL && npages < MAX_HUGESIZES) {
+			if (sscanf(entry->d_name, "hugepages-%" SCNu64 "kB", &size) == 1 && size * 1024 / getpagesize() > 1) {
+				pages[npages++] = size * 1024 / getpagesize();
+			}
+		}
+
+		closedir(hdir);
+	}
+
+	// Largest first without duplicates
+	qsort(pages, npages, sizeof(uint64_t), hugesizes_cmp);
+
+	for (loop = 0; loop < npages; loop++) {
+		if (globals->nhugesizes == 0 || globals->hugesizes[globals->nhugesizes - 1] != pages[loop]) {
+			globals->hugesizes[globals->nhugesizes++] = pages[loop];
+		}
+	}
+}
+
+uint64_t kpagerun(struct global *globals, struct scanctx *ctx, uint64_t first, uint64_t nreq)
+{
+	uint64_t startpfn = ctx->kpreq[first].pfn;
+	uint64_t endpfn = startpfn;
+	uint64_t last;
+
+	for (last = first; last + 1 < nreq; last++) {
+		if (ctx->kpreq[last + 1].pfn - endpfn > KPAGE_GAP) break;
+		if (ctx->kpreq[last + 1].pfn - startpfn >= globals->bufentries) break;
+		endpfn = ctx->kpreq[last + 1].pfn;
+	}
+
+	return last;
+}
+
+void readkpages(struct global *globals, struct scanctx *ctx, int kind, uint64_t pfn, uint64_t count, uint64_t *buf, uint64_t *got)
+{
+	ssize_t b;
+	int hfile;
+	int phase;
+	uint64_t start = prof_start(ctx->prof);
+
+	if (kind == KPAGE_GOTCOUNT) {
+		hfile = globals->hkpagecount;
+		phase = PROF_KPAGECOUNT;
+	} else if (kind == KPAGE_GOTFLAGS) {
+		hfile = globals->hkpageflags;
+		phase = PROF_KPAGEFLAGS;
+	} else {
+		hfile = globals->hpageidle;
+		phase = PROF_PAGEIDLE;
+	}
+
+	if (globals->snap != NULL) {
+		// Look up the snapshot, PFNs it doesn't hold read as KPAGE_NONE and aren't counted at the end
+		snap_readkpages(globals->snap, kind == KPAGE_GOTCOUNT, pfn, count, buf);
+		for (*got = count; *got > 0 && buf[*got - 1] == KPAGE_NONE; --*got);
+		prof_end(ctx->prof, phase, start, count * sizeof(uint64_t));
+		return;
+	}
+
+	b = pread64(hfile, buf, count * sizeof(uint64_t), pfn * sizeof(uint64_t));
+
+	if (b <= 0) *got = 0;
+	else *got = b / sizeof(uint64_t);
+
+	prof_end(ctx->prof, phase, start, *got * sizeof(uint64_t));
+}
+
+ssize_t readpagemap(struct global *globals, struct scanctx *ctx, int hpagemap, uint64_t *buf, uint64_t entries, uint64_t page)
+{
+	ssize_t b;
+	uint64_t start = prof_start(ctx->prof);
+
+	if (globals->snap != NULL) {
+		// Decode entries from the snapshot
+		entries = snap_readpagemap(globals->snap, buf, entries, page);
+		b = (entries == 0 ? -1 : entries * sizeof(uint64_t));
+	} else {
+		b = pread64(hpagemap, buf, entries * sizeof(uint64_t), page * sizeof(uint64_t));
+	}
+
+	prof_end(ctx->prof, PROF_PAGEMAP, start, b > 0 ? b : 0);
+
+	return b;
+}
+
+int markidle(struct global *globals, struct scanctx *ctx)
+{
+	int result;
+	ssize_t b;
+	struct vmainfo vma;
+	uint64_t offset;
+	uint64_t entries;
+	uint64_t idx;
+	uint64_t nreq;
+	uint64_t first;
+	uint64_t last;
+	uint64_t startword;
+	uint64_t nwords;
+	uint64_t pfn;
+	unsigned int pagesize = getpagesize();
+
+	// Open page mapping and maps, these are reused by the scan after the idle window
+	result = scanctx_open(globals, ctx);
+	if (result != 0) return result;
+
+	while (maps_next(&ctx->maps, &vma, ctx->prof)){
+		if (!vma_filter(globals, &vma)) continue;
+
+		for (offset = vma.start; offset < vma.end; offset += entries * pagesize) {
+			// Read a block of page map entries
+			entries = (vma.end - offset) / pagesize;
+			if (entries > globals->bufentries) entries = globals->bufentries;
+
+			b = pread64(ctx->hpagemap, ctx->pmbuf, entries * sizeof(uint64_t), (offset / pagesize) * sizeof(uint64_t));
+			if (b <= 0) break;
+			entries = b / sizeof(uint64_t);
+
+			// Gather PFNs of present pages in the block
+			nreq = 0;
+
+			for (idx = 0; idx < entries; idx++) {
+				if (ctx->pmbuf[idx] & PM_PRESENT) {
+					ctx->kpreq[nreq].pfn = ctx->pmbuf[idx] & PM_PFN;
+					ctx->kpreq[nreq].idx = idx;
+					++nreq;
+				}
+			}
+
+			// Sort into PFN order
+			qsort(ctx->kpreq, nreq, sizeof(struct kpagereq), kpagereq_cmp);
+
+			for (first = 0; first < nreq; first = last + 1) {
+				// Set the idle bits for the same runs the scan will read back
+				last = kpagerun(globals, ctx, first, nreq);
+				startword = ctx->kpreq[first].pfn / 64;
+				nwords = ctx->kpreq[last].pfn / 64 - startword + 1;
+
+				memset(ctx->kpidle, 0, nwords * sizeof(uint64_t));
+
+				for (idx = first; idx <= last; idx++) {
+					pfn = ctx->kpreq[idx].pfn;
+					ctx->kpidle[pfn / 64 - startword] |= 1ULL << (pfn % 64);
+				}
+
+				if (pwrite64(globals->hpageidle, ctx->kpidle, nwords * sizeof(uint64_t), startword * sizeof(uint64_t)) < 0 &&
+				    errno != ENXIO) {
+					fprintf(stderr, "Error writing " PAGE_IDLE_BITMAP ": ");
+					perror(NULL);
+					return RET_IDLE;
+				}
+			}
+		}
+	}
+
+	return RET_OK;
+}
+
+int snap_capture(struct global *globals, struct scanctx *ctx)
+{
+	int result = RET_OK;
+	ssize_t b;
+	FILE *hsnap = NULL;
+	size_t mapslen;
+	struct vmainfo vma;
+	struct snaphdr hdr;
+	struct snapext ext;
+	struct snapkp *kps = NULL;
+	uint64_t nkps = 0;
+	uint64_t maxkps = 0;
+	uint64_t nvmas = 0;
+	uint64_t offset;
+	uint64_t entries;
+	uint64_t idx;
+	uint64_t entry;
+	uint64_t zero = 0;
+	int kpneed = 0;
+	unsigned int pagesize = getpagesize();
+
+	// Pages are only recorded with every kernel page detail the header claims
+	if (globals->hkpagecount >= 0) kpneed |= KPAGE_GOTCOUNT;
+	if (globals->hkpageflags >= 0) kpneed |= KPAGE_GOTFLAGS;
+
+	// Open page mapping and maps
+	result = scanctx_open(globals, ctx);
+	if (result != 0) return result;
+
+	do {
+		// Load the maps text so the snapshot matches the sections scanned
+		if (!maps_load(&ctx->maps) || ctx->maps.len == 0) {
+			fprintf(stderr, "Error reading maps for process %" PRIu64 "\n", ctx->pid);
+			result = RET_SNAPSHOT;
+			break;
+		}
+
+		hsnap = fopen(globals->capture, "wb");
+
+		if (hsnap == NULL) {
+			fprintf(stderr, "Error opening %s: ", globals->capture);
+			perror(NULL);
+			result = RET_SNAPSHOT;
+			break;
+		}
+
+		// Header is written last, maps text follows it
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+		hdr.version = SNAP_VERSION;
+		hdr.pagesize = pagesize;
+		hdr.pid = ctx->pid;
+		hdr.tid = ctx->tid;
+		hdr.time = time(NULL);
+		if (globals->hkpagecount >= 0) hdr.flags |= SNAP_KPAGECOUNT;
+		if (globals->hkpageflags >= 0) hdr.flags |= SNAP_KPAGEFLAGS;
+
+		fwrite(&hdr, sizeof(hdr), 1, hsnap);
+
+		// Written before sections are parsed from it in place
+		mapslen = ctx->maps.len;
+		hdr.mapsoff = sizeof(hdr);
+		hdr.mapslen = mapslen;
+		fwrite(ctx->maps.buf, 1, mapslen, hsnap);
+		fwrite(&zero, 1, (8 - mapslen % 8) % 8, hsnap);
+
+		// Page extents in address order
+		hdr.extoff = hdr.mapsoff + (mapslen + 7) / 8 * 8;
+		ext.pages = 0;
+
+		while (maps_next(&ctx->maps, &vma, ctx->prof)){
+			++nvmas;
+
+			for (offset = vma.start; offset < vma.end; offset += entries * pagesize) {
+				// Read a block of page map entries
+				entries = (vma.end - offset) / pagesize;
+				if (entries > globals->bufentries) entries = globals->bufentries;
+
+				b = readpagemap(globals, ctx, ctx->hpagemap, ctx->pmbuf, entries, offset / pagesize);
+				entries = (b > 0 ? b / sizeof(uint64_t) : 0);
+
+				if (entries == 0) {
+					// Record the rest of the section as unreadable
+					if (ext.pages > 0) {
+						fwrite(&ext, sizeof(ext), 1, hsnap);
+						++hdr.nexts;
+					}
+
+					ext.addr = offset;
+					ext.pages = (vma.end - offset) / pagesize;
+					ext.entry = SNAP_UNREADABLE;
+					fwrite(&ext, sizeof(ext), 1, hsnap);
+					++hdr.nexts;
+					ext.pages = 0;
+					break;
+				}
+
+				// Look up kernel page counts and flags for the block
+				decodeentries(globals, ctx, entries);
+				lookupkpages(globals, ctx, entries, 0, HUGE_NONE);
+
+				for (idx = 0; idx < entries; idx++) {
+					entry = ctx->pmbuf[idx];
+
+					if (ext.pages > 0 && (offset + idx * pagesize != ext.addr + ext.pages * pagesize ||
+					    entry != ext.entry + ext.pages * snap_step(ext.entry))) {
+						// Extent ends
+						fwrite(&ext, sizeof(ext), 1, hsnap);
+						++hdr.nexts;
+						ext.pages = 0;
+					}
+
+					if ((entry & (PM_PRESENT | PM_SWAPPED)) == 0) continue;
+
+					if (ext.pages == 0) {
+						ext.addr = offset + idx * pagesize;
+						ext.entry = entry;
+					}
+
+					++ext.pages;
+
+					if ((entry & PM_PRESENT) && kpneed != 0 && (ctx->kpgot[idx] & kpneed) == kpneed &&
+					    !snap_addkp(&kps, &nkps, &maxkps, entry & PM_PFN, ctx->kpcount[idx], ctx->kpflags[idx])) {
+						result = RET_NOMEM;
+						break;
+					}
+				}
+
+				if (result != RET_OK) break;
+			}
+
+			if (result != RET_OK) break;
+		}
+
+		if (result != RET_OK) {
+			fprintf(stderr, "Error: Unable to allocate snapshot buffers\n");
+			break;
+		}
+
+		if (ext.pages > 0) {
+			fwrite(&ext, sizeof(ext), 1, hsnap);
+			++hdr.nexts;
+		}
+
+		// Kernel page details in PFN order
+		hdr.kpoff = hdr.extoff + hdr.nexts * sizeof(struct snapext);
+		hdr.nkps = snap_mergekps(kps, nkps);
+		fwrite(kps, sizeof(struct snapkp), hdr.nkps, hsnap);
+
+		// Fill in the header
+		fseek(hsnap, 0, SEEK_SET);
+		fwrite(&hdr, sizeof(hdr), 1, hsnap);
+
+		if (ferror(hsnap)) {
+			fprintf(stderr, "Error writing %s\n", globals->capture);
+			result = RET_SNAPSHOT;
+			break;
+		}
+
+		printf("Captured %" PRIu64 " sections, %" PRIu64 " page extents and %" PRIu64 " kernel page runs to %s\n",
+		       nvmas, hdr.nexts, hdr.nkps, globals->capture);
+	} while (0);
+
+	if (hsnap != NULL && fclose(hsnap) != 0 && result == RET_OK) {
+		fprintf(stderr, "Error writing %s: ", globals->capture);
+		perror(NULL);
+		result = RET_SNAPSHOT;
+	}
+
+	if (kps != NULL) free(kps);
+
+	scanctx_close(ctx);
+
+	return result;
+}
+
+bool snap_addkp(struct snapkp **kps, uint64_t *nkps, uint64_t *maxkps, uint64_t pfn, uint64_t count, uint64_t flags)
+{
+	struct snapkp *last;
+	struct snapkp *grown;
+
+	if (*nkps > 0) {
+		// Extend the last run if this PFN follows on with the same details
+		last = &(*kps)[*nkps - 1];
+
+		if (pfn == last->pfn + last->pfns && count == last->count && flags == last->flags) {
+			++last->pfns;
+			return true;
+		}
+	}
+
+	if (*nkps == *maxkps) {
+		grown = (struct snapkp *) realloc(*kps, (*maxkps ? *maxkps * 2 : 4096) * sizeof(struct snapkp));
+		if (grown == NULL) return false;
+		*kps = grown;
+		*maxkps = (*maxkps ? *maxkps * 2 : 4096);
+	}
+
+	last = &(*kps)[(*nkps)++];
+	last->pfn = pfn;
+	last->pfns = 1;
+	last->count = count;
+	last->flags = flags;
+
+	return true;
+}
+
+int snapkp_cmp(const void *one, const void *two)
+{
+	const struct snapkp *kp1 = (const struct snapkp *) one;
+	const struct snapkp *kp2 = (const struct snapkp *) two;
+
+	if (kp1->pfn < kp2->pfn) return -1;
+	if (kp1->pfn > kp2->pfn) return 1;
+	return 0;
+}
+
+uint64_t snap_mergekps(struct snapkp *kps, uint64_t nkps)
+{
+	uint64_t in;
+	uint64_t out = 0;
+	uint64_t end;
+
+	if (nkps == 0) return 0;
+
+	// Sort runs into PFN order
+	qsort(kps, nkps, sizeof(struct snapkp), snapkp_cmp);
+
+	for (in = 1; in < nkps; in++) {
+		end = kps[out].pfn + kps[out].pfns;
+
+		if (kps[in].pfn < end) {
+			// Overlaps a page seen through another mapping, keep what is left over
+			if (kps[in].pfn + kps[in].pfns <= end) continue;
+			kps[in].pfns -= end - kps[in].pfn;
+			kps[in].pfn = end;
+		}
+
+		if (kps[in].pfn == end && kps[in].count == kps[out].count && kps[in].flags == kps[out].flags) {
+			// Join adjacent runs
+			kps[out].pfns += kps[in].pfns;
+			continue;
+		}
+
+		kps[++out] = kps[in];
+	}
+
+	return out + 1;
+}
+
+uint64_t snap_step(uint64_t entry)
+{
+	// Next page in an extent has the next PFN or swap offset
+	if (entry & PM_PRESENT) return (entry & PM_PFN) != 0 ? 1 : 0;
+	return 1 << 5;
+}
+
+int snap_open(const char *path, struct snapshot **snapp)
+{
+	struct snapshot *snap;
+	struct snaphdr *hdr;
+	struct stat st;
+
+	snap = (struct snapshot *) calloc(1, sizeof(struct snapshot));
+	if (snap == NULL) return RET_NOMEM;
+
+	snap->base = (char *) MAP_FAILED;
+	snap->hfile = open(path, O_RDONLY);
+
+	if (snap->hfile < 0 || fstat(snap->hfile, &st) != 0) {
+		fprintf(stderr, "Error opening %s: ", path);
+		perror(NULL);
+		snap_close(snap);
+		return RET_SNAPSHOT;
+	}
+
+	if ((size_t) st.st_size < sizeof(struct snaphdr)) {
+		fprintf(stderr, "Error: %s is not a PageMap snapshot\n", path);
+		snap_close(snap);
+		return RET_SNAPSHOT;
+	}
+
+	// Map the whole file
+	snap->size = st.st_size;
+	snap->base = (char *) mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, snap->hfile, 0);
+
+	if (snap->base == MAP_FAILED) {
+		fprintf(stderr, "Error mapping %s: ", path);
+		perror(NULL);
+		snap_close(snap);
+		return RET_SNAPSHOT;
+	}
+
+	hdr = snap->hdr = (struct snaphdr *) snap->base;
+
+	if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) != 0) {
+		fprintf(stderr, "Error: %s is not a PageMap snapshot\n", path);
+		snap_close(snap);
+		return RET_SNAPSHOT;
+	}
+
+	if (hdr->version != SNAP_VERSION) {
+		fprintf(stderr, "Error: %s is snapshot version %u, expected %u\n", path, hdr->version, SNAP_VERSION);
+		snap_close(snap);
+		return RET_SNAPSHOT;
+	}
+
+	if (hdr->pagesize != (uint32_t) getpagesize()) {
+		fprintf(stderr, "Error: %s was captured with %u byte pages\n", path, hdr->pagesize);
+		snap_close(snap);
+		return RET_SNAPSHOT;
+	}
+
+	if (hdr->mapsoff > snap->size || hdr->mapslen == 0 || hdr->mapslen > snap->size - hdr->mapsoff ||
+	    hdr->extoff % 8 != 0 || hdr->extoff > snap->size || hdr->nexts > (snap->size - hdr->extoff) / sizeof(struct snapext) ||
+	    hdr->kpoff % 8 != 0 || hdr->kpoff > snap->size || hdr->nkps > (snap->size - hdr->kpoff) / sizeof(struct snapkp)) {
+		fprintf(stderr, "Error: %s is truncated or corrupt\n", path);
+		snap_close(snap);
+		return RET_SNAPSHOT;
+	}
+
+	snap->exts = (struct snapext *) (snap->base + hdr->extoff);
+	snap->kps = (struct snapkp *) (snap->base + hdr->kpoff);
+
+	*snapp = snap;
+
+	return RET_OK;
+}
+
+void snap_close(struct snapshot *snap)
+{
+	if (snap->base != MAP_FAILED) munmap(snap->base, snap->size);
+	if (snap->hfile >= 0) close(snap->hfile);
+	free(snap);
+}
+
+uint64_t snap_readpagemap(struct snapshot *snap, uint64_t *buf, uint64_t entries, uint64_t page)
+{
+	uint64_t pagesize = snap->hdr->pagesize;
+	uint64_t addr = page * pagesize;
+	uint64_t end = addr + entries * pagesize;
+	uint64_t lo = 0;
+	uint64_t hi = snap->hdr->nexts;
+	uint64_t mid;
+	uint64_t first;
+	uint64_t last;
+	uint64_t loop;
+	struct snapext *ext;
+
+	memset(buf, 0, entries * sizeof(uint64_t));
+
+	// Find the first extent ending after the start address
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		ext = &snap->exts[mid];
+		if (ext->addr + ext->pages * pagesize <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+
+	for (; lo < snap->hdr->nexts && snap->exts[lo].addr < end; lo++) {
+		// Expand the overlapping part of the extent
+		ext = &snap->exts[lo];
+		first = (ext->addr > addr ? (ext->addr - addr) / pagesize : 0);
+		last = (ext->addr + ext->pages * pagesize < end ? (ext->addr + ext->pages * pagesize - addr) / pagesize : entries);
+
+		// Reads stop short at unreadable pages
+		if (ext->entry == SNAP_UNREADABLE) return first;
+
+		for (loop = first; loop < last; loop++) {
+			buf[loop] = ext->entry + ((addr + loop * pagesize - ext->addr) / pagesize) * snap_step(ext->entry);
+		}
+	}
+
+	return entries;
+}
+
+uint64_t snap_unreadable(struct snapshot *snap, uint64_t page)
+{
+	uint64_t pagesize = snap->hdr->pagesize;
+	uint64_t addr = page * pagesize;
+	uint64_t lo = 0;
+	uint64_t hi = snap->hdr->nexts;
+	uint64_t mid;
+	struct snapext *ext;
+
+	// Find the extent ending after the address
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		ext = &snap->exts[mid];
+		if (ext->addr + ext->pages * pagesize <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if (lo == snap->hdr->nexts) return 0;
+
+	// Pages left of the unreadable extent covering the address
+	ext = &snap->exts[lo];
+	if (ext->entry != SNAP_UNREADABLE || ext->addr > addr) return 0;
+
+	return ext->pages - (addr - ext->addr) / pagesize;
+}
+
+void snap_readkpages(struct snapshot *snap, bool counts, uint64_t pfn, uint64_t count, uint64_t *buf)
+{
+	uint64_t lo = 0;
+	uint64_t hi = snap->hdr->nkps;
+	uint64_t mid;
+	uint64_t loop;
+	struct snapkp *kp;
+
+	for (loop = 0; loop < count; loop++) buf[loop] = KPAGE_NONE;
+
+	// Find the first run ending after the PFN
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		kp = &snap->kps[mid];
+		if (kp->pfn + kp->pfns <= pfn) lo = mid + 1;
+		else hi = mid;
+	}
+
+	for (; lo < snap->hdr->nkps && snap->kps[lo].pfn < pfn + count; lo++) {
+		kp = &snap->kps[lo];
+
+		for (loop = (kp->pfn > pfn ? kp->pfn - pfn : 0); loop < count && pfn + loop < kp->pfn + kp->pfns; loop++) {
+			buf[loop] = (counts ? kp->count : kp->flags);
+		}
+	}
+}
+
+struct kcache *kcache_create()
+{
+	struct kcache *cache;
+
+	cache = (struct kcache *) malloc(sizeof(struct kcache));
+
+	if (cache != NULL) {
+		pthread_mutex_init(&cache->lock, NULL);
+		cache->nchunks = 0;
+		cache->chunks = NULL;
+	}
+
+	return cache;
+}
+
+void kcache_destroy(struct kcache *cache)
+{
+	uint64_t chunk;
+
+	for (chunk = 0; chunk < cache->nchunks; chunk++) {
+		if (cache->chunks[chunk] != NULL) free(cache->chunks[chunk]);
+	}
+
+	if (cache->chunks != NULL) free(cache->chunks);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+bool kcache_get(struct kcache *cache, uint64_t pfn, uint64_t *count, uint64_t *flags)
+{
+	struct kcachechunk *chunk;
+	uint64_t slot = pfn & (KCACHE_CHUNK - 1);
+
+	if ((pfn >> KCACHE_SHIFT) >= cache->nchunks) return false;
+
+	chunk = cache->chunks[pfn >> KCACHE_SHIFT];
+	if (chunk == NULL) return false;
+
+	if ((chunk->valid[slot / 64] & (1ULL << (slot % 64))) == 0) return false;
+
+	*count = chunk->count[slot];
+	*flags = chunk->flags[slot];
+
+	return true;
+}
+
+void kcache_put(struct kcache *cache, uint64_t pfn, uint64_t count, uint64_t flags)
+{
+	struct kcachechunk *chunk;
+	uint64_t chunkno = pfn >> KCACHE_SHIFT;
+	uint64_t slot = pfn & (KCACHE_CHUNK - 1);
+
+	if (chunkno >= cache->nchunks) {
+		// Grow the chunk table to cover this PFN
+		struct kcachechunk **chunks;
+		uint64_t nchunks = cache->nchunks ? cache->nchunks : 64;
+
+		while (nchunks <= chunkno) nchunks *= 2;
+		if (nchunks > SIZE_MAX / sizeof(struct kcachechunk *)) return;
+
+		chunks = (struct kcachechunk **) realloc(cache->chunks, nchunks * sizeof(struct kcachechunk *));
+		if (chunks == NULL) return;
+
+		memset(chunks + cache->nchunks, 0, (nchunks - cache->nchunks) * sizeof(struct kcachechunk *));
+		cache->chunks = chunks;
+		cache->nchunks = nchunks;
+	}
+
+	chunk = cache->chunks[chunkno];
+
+	if (chunk == NULL) {
+		// Allocate chunk on first use
+		chunk = (struct kcachechunk *) calloc(1, sizeof(struct kcachechunk));
+		if (chunk == NULL) return;
+
+		cache->chunks[chunkno] = chunk;
+	}
+
+	chunk->count[slot] = (uint32_t) (count > UINT32_MAX ? UINT32_MAX : count);
+	chunk->flags[slot] = flags;
+	chunk->valid[slot / 64] |= 1ULL << (slot % 64);
+}
+
+#define MAX_CMDLINE 200
+
+void tidy_buf(char *buf, int b)
+{
+	char *ch;
+	int loop;
+
+	buf[b - 1] = '\x0';
+	for (ch = buf, loop = 0; loop < b - 1; loop++, ch++) {
+		if (*ch == '\x0') *ch = ' ';
+		else if (!isprint(*ch)) *ch = '.';
+	}
+}
+
+bool cmdlinefrom(uint64_t pid, const char* file, char* buf, int width)
+{
+	bool ok = false;
+	int hcmdline;
+	char path[PATH_MAX + 1];
+	int b;
+
+	sprintf(path, "/proc/%" PRIu64 "/%s", pid, file);
+	hcmdline = open(path, O_RDONLY);
+
+	if (hcmdline >= 0) {
+		b = read(hcmdline, buf, width);
+
+		if (b > 0) {
+			tidy_buf(buf, b);
+			ok = true;
+		}
+
+		close(hcmdline);
+	}
+
+	return ok;
+}
+
+char *getcmdline(uint64_t pid, int width)
+{
+	char *buf;
+	char *cmdline;
+	
+	if (width == 0) width = MAX_CMDLINE;
+	buf = (char *) malloc(width);
+	cmdline = (char *) malloc(width + 2);
+
+	if (buf == NULL || cmdline == NULL) {
+		if (buf != NULL) free(buf);
+		if (cmdline != NULL) free(cmdline);
+		return NULL;
+	}
+
+	if (cmdlinefrom(pid, "cmdline", buf, width)) {
+		sprintf(cmdline, "%s", buf);
+	} else if (cmdlinefrom(pid, "comm", buf, width)) {
+		sprintf(cmdline, "[%s]", buf);
+	} else {
+		sprintf(cmdline, "<Unknown>");
+	}
+
+	free(buf);
+
+	return cmdline;
+}
+
+struct xref *xref_create()
+{
+	struct xref *xref;
+
+	xref = (struct xref *) calloc(1, sizeof(struct xref));
+	if (xref != NULL) pthread_mutex_init(&xref->lock, NULL);
+
+	return xref;
+}
+
+void xref_destroy(struct xref *xref)
+{
+	pthread_mutex_destroy(&xref->lock);
+	if (xref->runs != NULL) free(xref->runs);
+	if (xref->procs != NULL) free(xref->procs);
+	free(xref);
+}
+
+void xref_add(struct global *globals, struct scanctx *ctx, uint64_t pfn, uint64_t addr)
+{
+	struct xrefrun *run;
+	uint64_t vpn = addr / getpagesize();
+
+	if (ctx->nxref > 0) {
+		// Extend the last run if the page follows on in both address spaces
+		run = &ctx->xrefbuf[ctx->nxref - 1];
+
+		if (run->pid == ctx->pid && pfn == run->pfn + run->pages && vpn == run->vpn + run->pages && run->pages < UINT32_MAX) {
+			++run->pages;
+			return;
+		}
+	}
+
+	if (ctx->nxref == XREF_BATCH) xref_flush(globals, ctx);
+
+	run = &ctx->xrefbuf[ctx->nxref++];
+	run->pfn = pfn;
+	run->vpn = vpn;
+	run->pid = ctx->pid;
+	run->pages = 1;
+}
+
+void xref_flush(struct global *globals, struct scanctx *ctx)
+{
+	struct xref *xref = globals->xref;
+	struct xrefrun *runs;
+	uint64_t maxruns;
+	uint64_t loop;
+
+	pthread_mutex_lock(&xref->lock);
+
+	if (xref->nruns + ctx->nxref > xref->maxruns && !xref->failed) {
+		// Grow the index
+		maxruns = (xref->maxruns ? xref->maxruns * 2 : 65536);
+		while (maxruns < xref->nruns + ctx->nxref) maxruns *= 2;
+
+		runs = (struct xrefrun *) realloc(xref->runs, maxruns * sizeof(struct xrefrun));
+
+		if (runs == NULL) {
+			xref->failed = true;
+		} else {
+			xref->runs = runs;
+			xref->maxruns = maxruns;
+		}
+	}
+
+	if (!xref->failed) {
+		memcpy(xref->runs + xref->nruns, ctx->xrefbuf, ctx->nxref * sizeof(struct xrefrun));
+		xref->nruns += ctx->nxref;
+
+		for (loop = 0; loop < ctx->nxref; loop++) {
+			if (ctx->xrefbuf[loop].pages > xref->maxpages) xref->maxpages = ctx->xrefbuf[loop].pages;
+		}
+	}
+
+	pthread_mutex_unlock(&xref->lock);
+
+	ctx->nxref = 0;
+}
+
+void xref_addgroup(struct global *globals, uint32_t pid)
+{
+	struct xref *xref = globals->xref;
+	struct xrefproc *procs;
+	char name[MAX_GROUPNAME];
+	uint64_t maxprocs;
+
+	if (!group_name(globals, pid, name)) return;
+
+	pthread_mutex_lock(&xref->lock);
+
+	if (xref->nprocs == xref->maxprocs) {
+		maxprocs = (xref->maxprocs ? xref->maxprocs * 2 : 256);
+		procs = (struct xrefproc *) realloc(xref->procs, maxprocs * sizeof(struct xrefproc));
+
+		if (procs != NULL) {
+			xref->procs = procs;
+			xref->maxprocs = maxprocs;
+		}
+	}
+
+	// Left unnamed if the list can't grow, the group is looked up again when accounting
+	if (xref->nprocs < xref->maxprocs) {
+		xref->procs[xref->nprocs].pid = pid;
+		strcpy(xref->procs[xref->nprocs].group, name);
+		++xref->nprocs;
+	}
+
+	pthread_mutex_unlock(&xref->lock);
+}
+
+int xrefrun_cmp(const void *one, const void *two)
+{
+	const struct xrefrun *run1 = (const struct xrefrun *) one;
+	const struct xrefrun *run2 = (const struct xrefrun *) two;
+
+	if (run1->pfn < run2->pfn) return -1;
+	if (run1->pfn > run2->pfn) return 1;
+	if (run1->pid < run2->pid) return -1;
+	if (run1->pid > run2->pid) return 1;
+	return 0;
+}
+
+uint64_t xref_first(struct xref *xref, uint64_t pfn)
+{
+	uint64_t lo = 0;
+	uint64_t hi = xref->nruns;
+	uint64_t mid;
+	uint64_t from = (pfn >= xref->maxpages ? pfn - xref->maxpages + 1 : 0);
+
+	// First run that could still cover the PFN
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (xref->runs[mid].pfn < from) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+int xrefend_cmp(const void *one, const void *two)
+{
+	const struct xrefend *end1 = (const struct xrefend *) one;
+	const struct xrefend *end2 = (const struct xrefend *) two;
+
+	if (end1->pfn < end2->pfn) return -1;
+	if (end1->pfn > end2->pfn) return 1;
+	return 0;
+}
+
+bool xref_sweep(struct xref *xref, void (*visit)(struct xrefspan *span, void *arg), void *arg)
+{
+	struct xrefend *ends;
+	struct xrefspan span;
+	uint64_t nextstart = 0;
+	uint64_t nextend = 0;
+	uint64_t pfn = 0;
+	uint64_t next;
+	uint64_t loop;
+
+	// Walk PFN order keeping the runs covering each interval between run starts and ends
+	ends = (struct xrefend *) malloc((xref->nruns ? xref->nruns : 1) * sizeof(struct xrefend));
+	span.active = (struct xrefrun **) malloc((xref->nruns ? xref->nruns : 1) * sizeof(struct xrefrun *));
+
+	if (ends == NULL || span.active == NULL) {
+		if (ends != NULL) free(ends);
+		if (span.active != NULL) free(span.active);
+		return false;
+	}
+
+	for (loop = 0; loop < xref->nruns; loop++) {
+		ends[loop].pfn = xref->runs[loop].pfn + xref->runs[loop].pages;
+		ends[loop].run = &xref->runs[loop];
+	}
+
+	qsort(ends, xref->nruns, sizeof(struct xrefend), xrefend_cmp);
+
+	span.nactive = 0;
+
+	while (nextstart < xref->nruns || nextend < xref->nruns) {
+		// Drop runs ending here
+		while (nextend < xref->nruns && ends[nextend].pfn == pfn) {
+			for (loop = 0; loop < span.nactive; loop++) {
+				if (span.active[loop] == ends[nextend].run) {
+					span.active[loop] = span.active[--span.nactive];
+					break;
+				}
+			}
+
+			++nextend;
+		}
+
+		// Add runs starting here
+		while (nextstart < xref->nruns && xref->runs[nextstart].pfn == pfn) {
+			span.active[span.nactive++] = &xref->runs[nextstart++];
+		}
+
+		// Interval runs to the next start or end
+		next = UINT64_MAX;
+		if (nextstart < xref->nruns) next = xref->runs[nextstart].pfn;
+		if (nextend < xref->nruns && ends[nextend].pfn < next) next = ends[nextend].pfn;
+
+		if (span.nactive > 0) {
+			span.pfn = pfn;
+			span.pages = next - pfn;
+			visit(&span, arg);
+		}
+
+		pfn = next;
+	}
+
+	free(ends);
+	free(span.active);
+
+	return true;
+}
+
+int xref_report(struct global *globals)
+{
+	struct xref *xref = globals->xref;
+	int result;
+
+	if (xref->failed) {
+		fprintf(stderr, "Error: Unable to allocate reverse PFN index\n");
+		return RET_NOMEM;
+	}
+
+	// Sort runs into PFN order
+	qsort(xref->runs, xref->nruns, sizeof(struct xrefrun), xrefrun_cmp);
+
+	if (globals->groupby != 0) {
+		printf("\n");
+		result = xref_groups(globals);
+		if (result != RET_OK) return result;
+	}
+
+	if (globals->xrefmode != 0) printf("\n");
+
+	switch (globals->xrefmode) {
+	case XREF_TOP:
+		return xref_top(globals);
+
+	case XREF_PFN:
+		return xref_pfn(globals);
+
+	case XREF_VMA:
+		return xref_vma(globals);
+
+	}
+
+	return RET_OK;
+}
+
+int pid_cmp(const void *one, const void *two)
+{
+	uint32_t pid1 = *((const uint32_t *) one);
+	uint32_t pid2 = *((const uint32_t *) two);
+
+	if (pid1 < pid2) return -1;
+	if (pid1 > pid2) return 1;
+	return 0;
+}
+
+int xrefgroup_cmp(const void *one, const void *two)
+{
+	const struct xrefgroup *group1 = (const struct xrefgroup *) one;
+	const struct xrefgroup *group2 = (const struct xrefgroup *) two;
+	uint64_t loop;
+
+	if (group1->npids < group2->npids) return -1;
+	if (group1->npids > group2->npids) return 1;
+
+	for (loop = 0; loop < group1->npids; loop++) {
+		if (group1->pids[loop] < group2->pids[loop]) return -1;
+		if (group1->pids[loop] > group2->pids[loop]) return 1;
+	}
+
+	return 0;
+}
+
+int xrefgroup_sizecmp(const void *one, const void *two)
+{
+	const struct xrefgroup *group1 = (const struct xrefgroup *) one;
+	const struct xrefgroup *group2 = (const struct xrefgroup *) two;
+
+	if (group1->pages > group2->pages) return -1;
+	if (group1->pages < group2->pages) return 1;
+	return xrefgroup_cmp(one, two);
+}
+
+void xref_topvisit(struct xrefspan *span, void *arg)
+{
+	struct xreftop *top = (struct xreftop *) arg;
+	struct xrefgroup *group;
+	struct xrefgroup *groups;
+	uint64_t npids = 0;
+	uint64_t loop;
+
+	if (span->nactive < 2 || top->failed) return;
+
+	// Distinct processes mapping the interval
+	for (loop = 0; loop < span->nactive; loop++) top->pids[loop] = span->active[loop]->pid;
+	qsort(top->pids, span->nactive, sizeof(uint32_t), pid_cmp);
+
+	for (loop = 0; loop < span->nactive; loop++) {
+		if (npids == 0 || top->pids[npids - 1] != top->pids[loop]) top->pids[npids++] = top->pids[loop];
+	}
+
+	if (top->ngroups > 0) {
+		// Consecutive intervals usually have the same mappers
+		group = &top->groups[top->ngroups - 1];
+
+		if (group->npids == npids && memcmp(group->pids, top->pids, npids * sizeof(uint32_t)) == 0) {
+			group->pages += span->pages;
+			group->mappings += span->pages * span->nactive;
+			return;
+		}
+	}
+
+	if (top->ngroups == top->maxgroups) {
+		groups = (struct xrefgroup *) realloc(top->groups, (top->maxgroups ? top->maxgroups * 2 : 1024) * sizeof(struct xrefgroup));
+
+		if (groups == NULL) {
+			top->failed = true;
+			return;
+		}
+
+		top->groups = groups;
+		top->maxgroups = (top->maxgroups ? top->maxgroups * 2 : 1024);
+	}
+
+	group = &top->groups[top->ngroups];
+	group->pids = (uint32_t *) malloc(npids * sizeof(uint32_t));
+
+	if (group->pids == NULL) {
+		top->failed = true;
+		return;
+	}
+
+	memcpy(group->pids, top->pids, npids * sizeof(uint32_t));
+	group->npids = npids;
+	group->pages = span->pages;
+	group->mappings = span->pages * span->nactive;
+	++top->ngroups;
+}
+
+int xref_top(struct global *globals)
+{
+	struct xreftop top;
+	struct xrefgroup *group;
+	uint64_t in;
+	uint64_t out = 0;
+	uint64_t loop;
+	uint64_t pid;
+	char *cmdline;
+	int result = RET_OK;
+
+	memset(&top, 0, sizeof(top));
+	top.pids = (uint32_t *) malloc((globals->xref->nruns ? globals->xref->nruns : 1) * sizeof(uint32_t));
+
+	if (top.pids == NULL || !xref_sweep(globals->xref, xref_topvisit, &top) || top.failed) {
+		fprintf(stderr, "Error: Unable to allocate sharing groups\n");
+		result = RET_NOMEM;
+
+	} else {
+		// Merge groups with the same processes
+		qsort(top.groups, top.ngroups, sizeof(struct xrefgroup), xrefgroup_cmp);
+
+		for (in = 0; in < top.ngroups; in++) {
+			if (out > 0 && xrefgroup_cmp(&top.groups[out - 1], &top.groups[in]) == 0) {
+				top.groups[out - 1].pages += top.groups[in].pages;
+				top.groups[out - 1].mappings += top.groups[in].mappings;
+				free(top.groups[in].pids);
+			} else {
+				top.groups[out++] = top.groups[in];
+			}
+		}
+
+		top.ngroups = out;
+
+		// Largest first
+		qsort(top.groups, top.ngroups, sizeof(struct xrefgroup), xrefgroup_sizecmp);
+
+		printf("====== Shared  Mappings    Procs Processes ======\n");
+
+		for (loop = 0; loop < top.ngroups && loop < globals->xreftop; loop++) {
+			group = &top.groups[loop];
+
+			printf("%11" PRIu64 "K %9" PRIu64 " %8" PRIu64, group->pages * getpagesize() / 1024, group->mappings, group->npids);
+
+			for (pid = 0; pid < group->npids; pid++) {
+				cmdline = getcmdline(group->pids[pid], 32);
+				printf("%s %" PRIu32 " %s", pid == 0 ? "" : ",", group->pids[pid], cmdline != NULL ? cmdline : "<Unknown>");
+				if (cmdline != NULL) free(cmdline);
+
+				if (pid == 3 && group->npids > 5) {
+					printf(", ... %" PRIu64 " more", group->npids - 4);
+					break;
+				}
+			}
+
+			printf("\n");
+		}
+	}
+
+	for (loop = 0; loop < top.ngroups; loop++) free(top.groups[loop].pids);
+	if (top.groups != NULL) free(top.groups);
+	if (top.pids != NULL) free(top.pids);
+
+	return result;
+}
+
+int xref_pfn(struct global *globals)
+{
+	struct xref *xref = globals->xref;
+	struct xrefrun *run;
+	uint64_t loop;
+	char *cmdline;
+
+	printf("====== Mappers of pfn %016" PRIx64 " ======\n", globals->xrefpfn);
+	printf("       PID          Address Process\n");
+
+	for (loop = xref_first(xref, globals->xrefpfn); loop < xref->nruns && xref->runs[loop].pfn <= globals->xrefpfn; loop++) {
+		run = &xref->runs[loop];
+		if (globals->xrefpfn >= run->pfn + run->pages) continue;
+
+		cmdline = getcmdline(run->pid, 0);
+		printf("%10" PRIu32 " %016" PRIx64 " %s\n", run->pid, (run->vpn + globals->xrefpfn - run->pfn) * getpagesize(),
+		       cmdline != NULL ? cmdline : "<Unknown>");
+		if (cmdline != NULL) free(cmdline);
+	}
+
+	return RET_OK;
+}
+
+int xrefsharer_cmp(const void *one, const void *two)
+{
+	const struct xrefsharer *sharer1 = (const struct xrefsharer *) one;
+	const struct xrefsharer *sharer2 = (const struct xrefsharer *) two;
+
+	if (sharer1->pid < sharer2->pid) return -1;
+	if (sharer1->pid > sharer2->pid) return 1;
+	return 0;
+}
+
+int xref_vma(struct global *globals)
+{
+	struct xref *xref = globals->xref;
+	struct xrefrun *run;
+	struct xrefrun *other;
+	struct xrefsharer *sharers = NULL;
+	struct xrefsharer *grown;
+	uint64_t nsharers = 0;
+	uint64_t maxsharers = 0;
+	uint64_t startvpn;
+	uint64_t endvpn;
+	uint64_t first;
+	uint64_t last;
+	uint64_t lo;
+	uint64_t hi;
+	uint64_t out;
+	uint64_t loop;
+	uint64_t scan;
+	char path[PATH_MAX + 1];
+	struct mapsreader maps;
+	struct vmainfo vma;
+	bool found = false;
+	char *cmdline;
+	unsigned int pagesize = getpagesize();
+
+	// Find the section
+	sprintf(path, "/proc/%" PRIu64 "/maps", globals->xrefpid);
+	memset(&maps, 0, sizeof(maps));
+
+	if (!maps_open(&maps, path, globals->mapquery, globals->xrefaddr, globals->xrefaddr + 1)) {
+		fprintf(stderr, "Error opening %s: ", path);
+		perror(NULL);
+		return RET_BADPID;
+	}
+
+	while (maps_next(&maps, &vma, NULL)) {
+		if (globals->xrefaddr >= vma.start && globals->xrefaddr < vma.end) {
+			found = true;
+			break;
+		}
+	}
+
+	if (!found) {
+		maps_free(&maps);
+		fprintf(stderr, "Error: No section at %" PRIx64 " in process %" PRIu64 "\n", globals->xrefaddr, globals->xrefpid);
+		return RET_BADARG;
+	}
+
+	printf("====== Sharers of %s [%s] %016" PRIx64 "-%016" PRIx64 " in %" PRIu64 " ======\n", vma.name, vma.perms,
+	       vma.start, vma.end, globals->xrefpid);
+	printf("       PID   Shared Process\n");
+
+	startvpn = vma.start / pagesize;
+	endvpn = vma.end / pagesize;
+
+	for (loop = 0; loop < xref->nruns; loop++) {
+		run = &xref->runs[loop];
+
+		// Part of the run in the section
+		if (run->pid != globals->xrefpid || run->vpn >= endvpn || run->vpn + run->pages <= startvpn) continue;
+
+		lo = run->pfn + (run->vpn < startvpn ? startvpn - run->vpn : 0);
+		hi = run->pfn + (run->vpn + run->pages > endvpn ? endvpn - run->vpn : run->pages);
+
+		for (scan = xref_first(xref, lo); scan < xref->nruns && xref->runs[scan].pfn < hi; scan++) {
+			other = &xref->runs[scan];
+
+			// The process's own other mappings of the pages aren't sharers
+			if (other->pid == globals->xrefpid || other->pfn + other->pages <= lo) continue;
+
+			// Pages of the section the other run maps too
+			first = (other->pfn > lo ? other->pfn : lo);
+			last = (other->pfn + other->pages < hi ? other->pfn + other->pages : hi);
+
+			if (nsharers == maxsharers) {
+				grown = (struct xrefsharer *) realloc(sharers, (maxsharers ? maxsharers * 2 : 256) * sizeof(struct xrefsharer));
+
+				if (grown == NULL) {
+					fprintf(stderr, "Error: Unable to allocate sharers\n");
+					if (sharers != NULL) free(sharers);
+					maps_free(&maps);
+					return RET_NOMEM;
+				}
+
+				sharers = grown;
+				maxsharers = (maxsharers ? maxsharers * 2 : 256);
+			}
+
+			sharers[nsharers].pid = other->pid;
+			sharers[nsharers].pages = last - first;
+			++nsharers;
+		}
+	}
+
+	// Total by process
+	qsort(sharers, nsharers, sizeof(struct xrefsharer), xrefsharer_cmp);
+
+	for (loop = 0, out = 0; loop < nsharers; loop++) {
+		if (out > 0 && sharers[out - 1].pid == sharers[loop].pid) sharers[out - 1].pages += sharers[loop].pages;
+		else sharers[out++] = sharers[loop];
+	}
+
+	for (loop = 0; loop < out; loop++) {
+		cmdline = getcmdline(sharers[loop].pid, 0);
+		printf("%10" PRIu32 " %7" PRIu64 "K %s\n", sharers[loop].pid, sharers[loop].pages * pagesize / 1024,
+		       cmdline != NULL ? cmdline : "<Unknown>");
+		if (cmdline != NULL) free(cmdline);
+	}
+
+	if (sharers != NULL) free(sharers);
+	maps_free(&maps);
+
+	return RET_OK;
+}
+
+bool group_name(struct global *globals, uint32_t pid, char *name)
+{
+	char path[PATH_MAX + 1];
+	char line[MAX_GROUPNAME + 16];
+	struct stat st;
+	struct passwd *pw;
+	FILE *hfile;
+	char *field;
+	char *cmdline;
+	unsigned long ppid;
+	uint32_t parent;
+	bool found = false;
+
+	switch (globals->groupby) {
+	case GROUP_UID:
+		// Owner of the process directory
+		sprintf(path, "/proc/%" PRIu32, pid);
+		if (stat(path, &st) != 0) return false;
+
+		pw = getpwuid(st.st_uid);
+		if (pw != NULL) snprintf(name, MAX_GROUPNAME, "%u %s", (unsigned int) st.st_uid, pw->pw_name);
+		else snprintf(name, MAX_GROUPNAME, "%u", (unsigned int) st.st_uid);
+
+		return true;
+
+	case GROUP_CGROUP:
+		// Unified hierarchy entry, else the first controller listed
+		sprintf(path, "/proc/%" PRIu32 "/cgroup", pid);
+		hfile = fopen(path, "r");
+		if (hfile == NULL) return false;
+
+		while (fgets(line, sizeof(line), hfile) != NULL) {
+			line[strcspn(line, "\n")] = '\x0';
+			field = strchr(line, ':');
+			if (field == NULL || (field = strchr(field + 1, ':')) == NULL) continue;
+
+			if (!found || strncmp(line, "0::", 3) == 0) {
+				snprintf(name, MAX_GROUPNAME, "%s", field + 1);
+				found = true;
+			}
+
+			if (strncmp(line, "0::", 3) == 0) break;
+		}
+
+		fclose(hfile);
+
+		return found;
+
+	case GROUP_TREE:
+		// Walk up to the ancestor started by init or kthreadd
+		for (;;) {
+			sprintf(path, "/proc/%" PRIu32 "/stat", pid);
+			hfile = fopen(path, "r");
+			if (hfile == NULL) return false;
+
+			found = (fgets(line, sizeof(line), hfile) != NULL);
+			fclose(hfile);
+
+			field = (found ? strrchr(line, ')') : NULL);
+			if (field == NULL || sscanf(field + 1, " %*c %lu", &ppid) != 1) return false;
+
+			parent = (uint32_t) ppid;
+			if (parent <= 2 || pid <= 2) break;
+			pid = parent;
+		}
+
+		cmdline = getcmdline(pid, 48);
+		snprintf(name, MAX_GROUPNAME, "%" PRIu32 " %s", pid, cmdline != NULL ? cmdline : "<Unknown>");
+		if (cmdline != NULL) free(cmdline);
+
+		return true;
+
+	}
+
+	return false;
+}
+
+int xrefmember_cmp(const void *one, const void *two)
+{
+	const struct xrefmember *member1 = (const struct xrefmember *) one;
+	const struct xrefmember *member2 = (const struct xrefmember *) two;
+
+	if (member1->pid < member2->pid) return -1;
+	if (member1->pid > member2->pid) return 1;
+	return 0;
+}
+
+int xrefproc_cmp(const void *one, const void *two)
+{
+	const struct xrefproc *proc1 = (const struct xrefproc *) one;
+	const struct xrefproc *proc2 = (const struct xrefproc *) two;
+
+	if (proc1->pid < proc2->pid) return -1;
+	if (proc1->pid > proc2->pid) return 1;
+	return 0;
+}
+
+int xrefacct_cmp(const void *one, const void *two)
+{
+	const struct xrefacct *acct1 = (const struct xrefacct *) one;
+	const struct xrefacct *acct2 = (const struct xrefacct *) two;
+
+	if (acct1->proportional > acct2->proportional) return -1;
+	if (acct1->proportional < acct2->proportional) return 1;
+	return strcmp(acct1->name, acct2->name);
+}
+
+void xref_groupvisit(struct xrefspan *span, void *arg)
+{
+	struct xrefgroups *groups = (struct xrefgroups *) arg;
+	struct xrefmember key;
+	struct xrefmember *member;
+	struct xrefacct *acct;
+	uint64_t ntouched = 0;
+	uint64_t loop;
+	uint32_t group;
+
+	// Count mappings of the interval by each group
+	for (loop = 0; loop < span->nactive; loop++) {
+		key.pid = span->active[loop]->pid;
+		member = (struct xrefmember *) bsearch(&key, groups->members, groups->nmembers, sizeof(struct xrefmember),
+		                                       xrefmember_cmp);
+		group = member->group;
+
+		if (groups->mappings[group]++ == 0) groups->touched[ntouched++] = group;
+	}
+
+	for (loop = 0; loop < ntouched; loop++) {
+		group = groups->touched[loop];
+		acct = &groups->accts[group];
+
+		acct->resident += span->pages;
+		if (groups->mappings[group] == span->nactive) acct->unique += span->pages;
+		acct->proportional += ((double) span->pages * groups->mappings[group]) / span->nactive;
+
+		groups->mappings[group] = 0;
+	}
+}
+
+bool xref_groupmembers(struct global *globals, struct xrefgroups *groups)
+{
+	struct xref *xref = globals->xref;
+	struct xrefacct *acct;
+	struct xrefproc key;
+	struct xrefproc *proc;
+	char name[MAX_GROUPNAME];
+	uint64_t loop;
+	uint64_t group;
+	uint64_t out = 0;
+
+	// Processes seen in the index
+	groups->members = (struct xrefmember *) malloc((xref->nruns ? xref->nruns : 1) * sizeof(struct xrefmember));
+	if (groups->members == NULL) return false;
+
+	for (loop = 0; loop < xref->nruns; loop++) groups->members[loop].pid = xref->runs[loop].pid;
+	qsort(groups->members, xref->nruns, sizeof(struct xrefmember), xrefmember_cmp);
+
+	for (loop = 0; loop < xref->nruns; loop++) {
+		if (out == 0 || groups->members[out - 1].pid != groups->members[loop].pid) groups->members[out++] = groups->members[loop];
+	}
+
+	groups->nmembers = out;
+
+	// At most one group per process
+	groups->accts = (struct xrefacct *) malloc((out ? out : 1) * sizeof(struct xrefacct));
+	if (groups->accts == NULL) return false;
+
+	qsort(xref->procs, xref->nprocs, sizeof(struct xrefproc), xrefproc_cmp);
+
+	// Assign each process to the group named when it was scanned
+	for (loop = 0; loop < groups->nmembers; loop++) {
+		key.pid = groups->members[loop].pid;
+		proc = (struct xrefproc *) bsearch(&key, xref->procs, xref->nprocs, sizeof(struct xrefproc), xrefproc_cmp);
+
+		if (proc != NULL) strcpy(name, proc->group);
+		else if (!group_name(globals, groups->members[loop].pid, name)) strcpy(name, "<Exited>");
+
+		for (group = 0; group < groups->naccts; group++) {
+			if (strcmp(groups->accts[group].name, name) == 0) break;
+		}
+
+		if (group == groups->naccts) {
+			acct = &groups->accts[groups->naccts++];
+			memset(acct, 0, sizeof(struct xrefacct));
+			strcpy(acct->name, name);
+		}
+
+		groups->members[loop].group = (uint32_t) group;
+		++groups->accts[group].procs;
+	}
+
+	// Per group mapping counts for each interval
+	groups->mappings = (uint32_t *) calloc(groups->naccts ? groups->naccts : 1, sizeof(uint32_t));
+	groups->touched = (uint32_t *) malloc((groups->naccts ? groups->naccts : 1) * sizeof(uint32_t));
+
+	return (groups->mappings != NULL && groups->touched != NULL);
+}
+
+int xref_groups(struct global *globals)
+{
+	struct xrefgroups groups;
+	struct xrefacct *acct;
+	uint64_t loop;
+	uint64_t kbpage = getpagesize() / 1024;
+	int result = RET_OK;
+
+	memset(&groups, 0, sizeof(groups));
+
+	if (!xref_groupmembers(globals, &groups) || !xref_sweep(globals->xref, xref_groupvisit, &groups)) {
+		fprintf(stderr, "Error: Unable to allocate group accounting\n");
+		result = RET_NOMEM;
+
+	} else {
+		// Largest share first
+		qsort(groups.accts, groups.naccts, sizeof(struct xrefacct), xrefacct_cmp);
+
+		printf("====== Resident    Unique    Shared Proportional    Procs Group ======\n");
+
+		for (loop = 0; loop < groups.naccts; loop++) {
+			acct = &groups.accts[loop];
+
+			printf("%14" PRIu64 "K %8" PRIu64 "K %8" PRIu64 "K %11.0fK %8" PRIu64 " %s\n", acct->resident * kbpage,
+			       acct->unique * kbpage, (acct->resident - acct->unique) * kbpage, acct->proportional * kbpage, acct->procs,
+			       acct->name);
+		}
+	}
+
+	if (groups.members != NULL) free(groups.members);
+	if (groups.accts != NULL) free(groups.accts);
+	if (groups.mappings != NULL) free(groups.mappings);
+	if (groups.touched != NULL) free(groups.touched);
+
+	return result;
+}
+
+int nodeid_cmp(const void *one, const void *two)
+{
+	return *((const int *) one) - *((const int *) two);
+}
+
+int noderange_cmp(const void *one, const void *two)
+{
+	const struct noderange *range1 = (const struct noderange *) one;
+	const struct noderange *range2 = (const struct noderange *) two;
+
+	if (range1->start < range2->start) return -1;
+	if (range1->start > range2->start) return 1;
+	return 0;
+}
+
+int nodes_load(struct global *globals)
+{
+	char path[PATH_MAX + 1];
+	FILE *hfile;
+	DIR *hdir;
+	struct dirent *entry;
+	struct noderange *ranges;
+	uint64_t maxranges = 0;
+	uint64_t blockpages = 0;
+	uint64_t block;
+	uint64_t blocks;
+	uint64_t out = 0;
+	uint64_t loop;
+	int *ids = NULL;
+	int *grown;
+	int nids = 0;
+	int maxids = 0;
+	int result = RET_OK;
+	int id;
+	int node;
+
+	// PFNs per memory block
+	hfile = fopen(MEMORY_BLOCK_SIZE, "r");
+
+	if (hfile != NULL) {
+		if (fscanf(hfile, "%" SCNx64, &blockpages) != 1) blockpages = 0;
+		blockpages /= getpagesize();
+		fclose(hfile);
+	}
+
+	// All nodes, lowest first
+	hdir = opendir(NODE_SYSFS);
+
+	if (hdir != NULL) {
+		while ((entry = readdir(hdir)) != NULL) {
+			if (sscanf(entry->d_name, "node%d", &id) != 1) continue;
+
+			if (nids == maxids) {
+				maxids = (maxids ? maxids * 2 : 64);
+				grown = (int *) realloc(ids, maxids * sizeof(int));
+
+				if (grown == NULL) {
+					closedir(hdir);
+					free(ids);
+					return RET_NOMEM;
+				}
+
+				ids = grown;
+			}
+
+			ids[nids++] = id;
+		}
+
+		closedir(hdir);
+	}
+
+	if (blockpages == 0 || nids == 0) {
+		fprintf(stderr, "Error: Unable to read NUMA memory layout from " NODE_SYSFS "\n");
+		if (ids != NULL) free(ids);
+		return RET_NUMA;
+	}
+
+	qsort(ids, nids, sizeof(int), nodeid_cmp);
+
+	// PFN range of each memory block on each node, memoryless nodes are left out
+	for (loop = 0; loop < (uint64_t) nids && result == RET_OK; loop++) {
+		sprintf(path, NODE_SYSFS "/node%d", ids[loop]);
+		hdir = opendir(path);
+		if (hdir == NULL) continue;
+
+		node = globals->nnodes;
+		blocks = 0;
+
+		while ((entry = readdir(hdir)) != NULL) {
+			if (sscanf(entry->d_name, "memory%" SCNu64, &block) != 1) continue;
+
+			if (node == MAX_NODES) {
+				fprintf(stderr, "Error: More than %d NUMA nodes with memory in " NODE_SYSFS "\n", MAX_NODES);
+				result = RET_NUMA;
+				break;
+			}
+
+			if (globals->nnoderanges == maxranges) {
+				maxranges = (maxranges ? maxranges * 2 : 256);
+				ranges = (struct noderange *) realloc(globals->noderanges, maxranges * sizeof(struct noderange));
+
+				if (ranges == NULL) {
+					result = RET_NOMEM;
+					break;
+				}
+
+				globals->noderanges = ranges;
+			}
+
+			globals->noderanges[globals->nnoderanges].start = block * blockpages;
+			globals->noderanges[globals->nnoderanges].end = (block + 1) * blockpages;
+			globals->noderanges[globals->nnoderanges].node = node;
+			++globals->nnoderanges;
+			++blocks;
+		}
+
+		closedir(hdir);
+
+		if (blocks > 0) globals->nodeids[globals->nnodes++] = ids[loop];
+	}
+
+	free(ids);
+	if (result != RET_OK) return result;
+
+	if (globals->nnoderanges == 0) {
+		fprintf(stderr, "Error: No memory blocks found in " NODE_SYSFS "\n");
+		return RET_NUMA;
+	}
+
+	// Sort and merge adjacent blocks on the same node
+	ranges = globals->noderanges;
+	qsort(ranges, globals->nnoderanges, sizeof(struct noderange), noderange_cmp);
+
+	for (loop = 0; loop < globals->nnoderanges; loop++) {
+		if (out > 0 && ranges[out - 1].end == ranges[loop].start && ranges[out - 1].node == ranges[loop].node) {
+			ranges[out - 1].end = ranges[loop].end;
+		} else {
+			ranges[out++] = ranges[loop];
+		}
+	}
+
+	globals->nnoderanges = out;
+
+	return RET_OK;
+}
+
+int pfn_node(struct global *globals, struct scanctx *ctx, uint64_t pfn)
+{
+	struct noderange *range = &globals->noderanges[ctx->nodehint];
+	uint64_t lo = 0;
+	uint64_t hi = globals->nnoderanges;
+	uint64_t mid;
+
+	// Neighbouring pages are usually in the same range
+	if (pfn >= range->start && pfn < range->end) return range->node;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		range = &globals->noderanges[mid];
+
+		if (pfn < range->start) {
+			hi = mid;
+		} else if (pfn >= range->end) {
+			lo = mid + 1;
+		} else {
+			ctx->nodehint = mid;
+			return range->node;
+		}
+	}
+
+	return -1;
+}
+
+bool vma_filter(struct global *globals, struct vmainfo *vma)
+{
+	const char *perm;
+
+	if (!globals->filter) return true;
+
+	// All required permissions
+	for (perm = globals->perms; *perm != '\x0'; perm++) {
+		if (strchr(vma->perms, *perm) == NULL) return false;
+	}
+
+	// Section name
+	if (globals->namefilter && regexec(&globals->nameregex, vma->name, 0, NULL, 0) != 0) return false;
+
+	// Address range, clipping sections partly inside it
+	if (vma->end <= globals->rangestart || vma->start >= globals->rangeend) return false;
+	if (vma->start < globals->rangestart) vma->start = globals->rangestart;
+	if (vma->end > globals->rangeend) vma->end = globals->rangeend;
+
+	return true;
+}
+
+uint64_t prof_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+uint64_t prof_start(struct profile *prof)
+{
+	// Only read the clock when profiling
+	if (prof == NULL) return 0;
+
+	return prof_now();
+}
+
+uint64_t prof_end(struct profile *prof, int phase, uint64_t start, uint64_t bytes)
+{
+	uint64_t ns;
+
+	if (prof == NULL) return 0;
+
+	ns = prof_now() - start;
+	prof->phase[phase].ns += ns;
+	prof->phase[phase].calls++;
+	prof->phase[phase].bytes += bytes;
+
+	return ns;
+}
+
+void prof_merge(struct profile *into, struct profile *from)
+{
+	int phase;
+
+	into->ns += from->ns;
+
+	for (phase = 0; phase < PROF_COUNT; phase++) {
+		into->phase[phase].ns += from->phase[phase].ns;
+		into->phase[phase].calls += from->phase[phase].calls;
+		into->phase[phase].bytes += from->phase[phase].bytes;
+	}
+}
+
+void prof_record(struct global *globals, uint64_t pid, struct profile *prof)
+{
+	int slot;
+	int phase;
+
+	// Add phases to the run, its time is measured around each scan
+	for (phase = 0; phase < PROF_COUNT; phase++) {
+		globals->prof.phase[phase].ns += prof->phase[phase].ns;
+		globals->prof.phase[phase].calls += prof->phase[phase].calls;
+		globals->prof.phase[phase].bytes += prof->phase[phase].bytes;
+	}
+
+	// Keep the slowest processes, slowest first
+	slot = globals->nproftop;
+	if (slot == PROF_TOPN) {
+		if (prof->ns <= globals->proftop[slot - 1].prof.ns) return;
+		--slot;
+	} else {
+		++globals->nproftop;
+	}
+
+	for (; slot > 0 && globals->proftop[slot - 1].prof.ns < prof->ns; slot--) {
+		globals->proftop[slot] = globals->proftop[slot - 1];
+	}
+
+	globals->proftop[slot].pid = pid;
+	globals->proftop[slot].prof = *prof;
+}
+
+const char *prof_names[PROF_COUNT] = {
+	"Enumerate /proc", "Parse maps", "Read pagemap", "Read kpagecount", "Read kpageflags", "Read page idle",
+	"Read cmdlines", "Format output"
+};
+
+void prof_report(struct global *globals)
+{
+	struct profile *prof = &globals->prof;
+	struct profile *top;
+	uint64_t phasens = 0;
+	uint64_t other;
+	int phase;
+	int loop;
+
+	// Phase totals for the run. Phases on parallel threads can add up to more than the run took
+	for (phase = 0; phase < PROF_COUNT; phase++) phasens += prof->phase[phase].ns;
+	other = (prof->ns > phasens ? prof->ns - phasens : 0);
+
+	fprintf(stderr, "============ Profile ============\n");
+	fprintf(stderr, "%-16s %12s %14s %11s %6s\n", "Phase", "Calls", "Bytes", "ms", "%");
+
+	for (phase = 0; phase < PROF_COUNT; phase++) {
+		fprintf(stderr, "%-16s %12" PRIu64 " %14" PRIu64 " %11.3f %6.1f\n", prof_names[phase], prof->phase[phase].calls,
+		        prof->phase[phase].bytes, prof->phase[phase].ns / 1e6,
+		        prof->ns != 0 ? 100.0 * prof->phase[phase].ns / prof->ns : 0.0);
+	}
+
+	fprintf(stderr, "%-16s %12s %14s %11.3f %6.1f\n", "Other", "", "", other / 1e6, prof->ns != 0 ? 100.0 * other / prof->ns : 0.0);
+	fprintf(stderr, "%-16s %12s %14s %11.3f\n", "Total", "", "", prof->ns / 1e6);
+
+	if (globals->nproftop == 0) return;
+
+	// Slowest processes, times in ms
+	fprintf(stderr, "============ Slowest processes ============\n");
+	fprintf(stderr, "       PID      Total      /proc       Maps    Pagemap     Kpages    Cmdline     Output  Pagemap MB\n");
+
+	for (loop = 0; loop < globals->nproftop; loop++) {
+		top = &globals->proftop[loop].prof;
+
+		fprintf(stderr, "%10" PRIu64 " %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %11.1f\n", globals->proftop[loop].pid,
+		        top->ns / 1e6, top->phase[PROF_PROCS].ns / 1e6, top->phase[PROF_MAPS].ns / 1e6,
+		        top->phase[PROF_PAGEMAP].ns / 1e6,
+		        (top->phase[PROF_KPAGECOUNT].ns + top->phase[PROF_KPAGEFLAGS].ns + top->phase[PROF_PAGEIDLE].ns) / 1e6,
+		        top->phase[PROF_CMDLINE].ns / 1e6, top->phase[PROF_OUTPUT].ns / 1e6,
+		        top->phase[PROF_PAGEMAP].bytes / 1048576.0);
+	}
+}
+
+int physscan(struct global *globals)
+{
+	struct physzone zones[MAX_ZONES];
+	struct physjob *jobs;
+	struct physstats *stats;
+	pthread_t *threads;
+	uint64_t maxpfn;
+	uint64_t per;
+	int nzones;
+	int njobs;
+	int started = 0;
+	int result = RET_OK;
+	int loop;
+	int zone;
+	int flag;
+
+	if (globals->hkpageflags < 0) {
+		fprintf(stderr, "Error: Scanning physical memory needs /proc/kpageflags\n");
+		return RET_PROCSCAN;
+	}
+
+	// Memory block table to place pages on nodes, as zone spans of different nodes can overlap
+	if (access(NODE_SYSFS, F_OK) == 0) {
+		result = nodes_load(globals);
+		if (result != RET_OK) return result;
+	}
+
+	// Physical range and zones within it
+	maxpfn = physscan_maxpfn(globals);
+	nzones = physscan_zones(zones);
+
+	// Spans overlapping on one node (Movable with kernelcore=) can't be told apart
+	for (loop = 0; loop < nzones; loop++) {
+		for (zone = loop + 1; zone < nzones && zones[zone].start < zones[loop].end; zone++) {
+			if (globals->nnoderanges > 0 && zones[zone].node != zones[loop].node) continue;
+
+			fprintf(stderr, "Warning: Node %d zone %s overlaps node %d zone %s, pages in both may be counted in either\n",
+			        zones[loop].node, zones[loop].name, zones[zone].node, zones[zone].name);
+		}
+	}
+
+	// Split the range into one block aligned part per thread
+	njobs = (globals->jobs > 1 ? globals->jobs : 1);
+	per = ((maxpfn / njobs) / PHYS_BLOCK + 1) * PHYS_BLOCK;
+
+	jobs = (struct physjob *) calloc(njobs, sizeof(struct physjob));
+	threads = (pthread_t *) malloc(njobs * sizeof(pthread_t));
+
+	if (jobs == NULL || threads == NULL) {
+		if (jobs != NULL) free(jobs);
+		if (threads != NULL) free(threads);
+		fprintf(stderr, "Error: Unable to allocate physical scan\n");
+		return RET_NOMEM;
+	}
+
+	for (loop = 0; loop < njobs; loop++) {
+		jobs[loop].globals = globals;
+		jobs[loop].zones = zones;
+		jobs[loop].nzones = nzones;
+		jobs[loop].start = (loop * per < maxpfn ? loop * per : maxpfn);
+		jobs[loop].end = ((loop + 1) * per < maxpfn ? (loop + 1) * per : maxpfn);
+	}
+
+	if (njobs == 1) {
+		physscan_worker(&jobs[0]);
+		started = 1;
+
+	} else {
+		for (loop = 0; loop < njobs; loop++) {
+			if (pthread_create(&threads[loop], NULL, physscan_worker, &jobs[loop]) != 0) break;
+			++started;
+		}
+
+		// Scan what is left in this thread
+		for (loop = started; loop < njobs; loop++) physscan_worker(&jobs[loop]);
+
+		for (loop = 0; loop < started; loop++) pthread_join(threads[loop], NULL);
+
+	}
+
+	// Combine the parts
+	stats = &jobs[0].stats;
+
+	for (loop = 0; loop < njobs; loop++) {
+		if (jobs[loop].result != RET_OK) result = jobs[loop].result;
+		if (loop == 0) continue;
+
+		stats->scanned += jobs[loop].stats.scanned;
+		stats->present += jobs[loop].stats.present;
+		stats->mapped += jobs[loop].stats.mapped;
+
+		for (flag = 0; flag < 64; flag++) stats->flags[flag] += jobs[loop].stats.flags[flag];
+
+		for (zone = 0; zone < nzones; zone++) {
+			stats->zones[zone].present += jobs[loop].stats.zones[zone].present;
+			stats->zones[zone].anon += jobs[loop].stats.zones[zone].anon;
+			stats->zones[zone].file += jobs[loop].stats.zones[zone].file;
+			stats->zones[zone].slab += jobs[loop].stats.zones[zone].slab;
+			stats->zones[zone].mapped += jobs[loop].stats.zones[zone].mapped;
+		}
+	}
+
+	if (result == RET_OK) physscan_print(stats, zones, nzones);
+
+	free(jobs);
+	free(threads);
+
+	return result;
+}
+
+uint64_t physscan_maxpfn(struct global *globals)
+{
+	uint64_t flags;
+	uint64_t lo = 0;
+	uint64_t hi = 1;
+
+	// Reads stop at the highest PFN, so find it by probing
+	while (hi < (UINT64_MAX >> 4) && pread(globals->hkpageflags, &flags, sizeof(flags), hi * sizeof(flags)) == sizeof(flags)) {
+		lo = hi;
+		hi *= 2;
+	}
+
+	while (hi - lo > 1) {
+		if (pread(globals->hkpageflags, &flags, sizeof(flags), (lo + (hi - lo) / 2) * sizeof(flags)) == sizeof(flags)) {
+			lo = lo + (hi - lo) / 2;
+		} else {
+			hi = lo + (hi - lo) / 2;
+		}
+	}
+
+	return hi;
+}
+
+int physzone_cmp(const void *one, const void *two)
+{
+	const struct physzone *zone1 = (const struct physzone *) one;
+	const struct physzone *zone2 = (const struct physzone *) two;
+
+	if (zone1->start < zone2->start) return -1;
+	if (zone1->start > zone2->start) return 1;
+	return 0;
+}
+
+int physscan_zones(struct physzone *zones)
+{
+	FILE *hfile;
+	char line[256];
+	char name[16];
+	int node;
+	int nzones = 0;
+	uint64_t value;
+	uint64_t spanned = 0;
+	struct physzone *zone = NULL;
+
+	hfile = fopen(ZONEINFO, "r");
+	if (hfile == NULL) return 0;
+
+	// Each zone heading is followed by its free pages, its span and later its first PFN
+	while (fgets(line, sizeof(line), hfile) != NULL) {
+		if (sscanf(line, "Node %d, zone %15s", &node, name) == 2) {
+			zone = NULL;
+			spanned = 0;
+			if (nzones == MAX_ZONES) continue;
+
+			zone = &zones[nzones];
+			zone->node = node;
+			strcpy(zone->name, name);
+			zone->free = 0;
+
+		} else if (zone != NULL && sscanf(line, " pages free %" SCNu64, &value) == 1) {
+			zone->free = value;
+
+		} else if (zone != NULL && sscanf(line, " spanned %" SCNu64, &value) == 1) {
+			spanned = value;
+
+		} else if (zone != NULL && sscanf(line, " start_pfn: %" SCNu64, &value) == 1) {
+			zone->start = value;
+			zone->end = value + spanned;
+			if (spanned != 0) ++nzones;
+			zone = NULL;
+
+		}
+	}
+
+	fclose(hfile);
+
+	qsort(zones, nzones, sizeof(struct physzone), physzone_cmp);
+
+	return nzones;
+}
+
+void *physscan_worker(void *arg)
+{
+	struct physjob *job = (struct physjob *) arg;
+	struct global *globals = job->globals;
+	struct physstats *stats = &job->stats;
+	struct physzonestats *zstats;
+	uint64_t *flagbuf;
+	uint64_t *countbuf;
+	uint64_t pfn;
+	uint64_t entries;
+	uint64_t idx;
+	uint64_t flags;
+	uint64_t bits;
+	uint64_t range = 0;
+	ssize_t b;
+	int zone = 0;
+	int node;
+	int flag;
+
+	flagbuf = (uint64_t *) malloc(PHYS_BLOCK * sizeof(uint64_t));
+	countbuf = (uint64_t *) malloc(PHYS_BLOCK * sizeof(uint64_t));
+
+	if (flagbuf == NULL || countbuf == NULL) {
+		job->result = RET_NOMEM;
+		if (flagbuf != NULL) free(flagbuf);
+		if (countbuf != NULL) free(countbuf);
+		return NULL;
+	}
+
+	for (pfn = job->start; pfn < job->end; pfn += entries) {
+		// Read a block of flags and mapping counts
+		entries = job->end - pfn;
+		if (entries > PHYS_BLOCK) entries = PHYS_BLOCK;
+
+		b = pread(globals->hkpageflags, flagbuf, entries * sizeof(uint64_t), pfn * sizeof(uint64_t));
+		if (b <= 0) break;
+		entries = b / sizeof(uint64_t);
+
+		if (globals->hkpagecount < 0 ||
+		    pread(globals->hkpagecount, countbuf, entries * sizeof(uint64_t), pfn * sizeof(uint64_t)) != b) {
+			memset(countbuf, 0, entries * sizeof(uint64_t));
+		}
+
+		stats->scanned += entries;
+
+		for (idx = 0; idx < entries; idx++) {
+			flags = flagbuf[idx];
+
+			// Holes in the physical map
+			if (flags & (1ULL << KPF_NOPAGE)) continue;
+
+			++stats->present;
+			if (countbuf[idx] != 0) ++stats->mapped;
+
+			for (bits = flags, flag = 0; bits != 0; bits >>= 1, flag++) {
+				if (bits & 1) ++stats->flags[flag];
+			}
+
+			// Node holding the page from the memory block table, blocks are in PFN order
+			node = -1;
+
+			if (globals->nnoderanges > 0) {
+				while (range < globals->nnoderanges && pfn + idx >= globals->noderanges[range].end) ++range;
+
+				if (range < globals->nnoderanges && pfn + idx >= globals->noderanges[range].start) {
+					node = globals->nodeids[globals->noderanges[range].node];
+				}
+			}
+
+			// Zone holding the page on that node, usually the same as the last page
+			if (zone == job->nzones || !physzone_holds(&job->zones[zone], pfn + idx, node)) {
+				for (zone = 0; zone < job->nzones && !physzone_holds(&job->zones[zone], pfn + idx, node); zone++);
+				if (zone == job->nzones) continue;
+			}
+
+			zstats = &stats->zones[zone];
+			++zstats->present;
+
+			// Free pages are totalled from zoneinfo, older kernels only flag the head of each free block
+			if ((flags & (1ULL << KPF_BUDDY)) == 0) {
+				if (flags & (1ULL << KPF_SLAB)) ++zstats->slab;
+				else if (flags & (1ULL << KPF_ANON)) ++zstats->anon;
+				else if (flags & (1ULL << KPF_LRU)) ++zstats->file;
+			}
+
+			if (countbuf[idx] != 0) ++zstats->mapped;
+		}
+	}
+
+	free(flagbuf);
+	free(countbuf);
+
+	return NULL;
+}
+
+bool physzone_holds(struct physzone *zone, uint64_t pfn, int node)
+{
+	if (pfn < zone->start || pfn >= zone->end) return false;
+
+	// Any node when the page's node isn't known
+	return node < 0 || zone->node == node;
+}
+
+void physscan_print(struct physstats *stats, struct physzone *zones, int nzones)
+{
+	struct physzonestats total;
+	uint64_t kbpage = getpagesize() / 1024;
+	uint64_t freepages = 0;
+	uint64_t nodefree = 0;
+	int zone;
+	int flag;
+
+	printf("============ Physical memory ============\n");
+	printf("Scanned:    %12" PRIu64 " kB\n", stats->scanned * kbpage);
+	printf("Present:    %12" PRIu64 " kB\n", stats->present * kbpage);
+
+	if (stats->present == 0) return;
+
+	printf("  Mapped:   %12" PRIu64 " kB (%.1f%%)\n", stats->mapped * kbpage, ((double) stats->mapped / (double) stats->present) * 100.0);
+
+	printf("============ Page flags ============\n");
+
+	for (zone = 0; zone < nzones; zone++) freepages += zones[zone].free;
+
+	for (flag = 0; flag < 64; flag++) {
+		if (stats->flags[flag] == 0 || flag == KPF_NOPAGE) continue;
+
+		if (kpageflag_names[flag] != NULL) printf("%-14s", kpageflag_names[flag]);
+		else printf("<%d>%*s", flag, flag < 10 ? 11 : 10, "");
+
+		printf("%10" PRIu64 " kB (%.1f%%)", stats->flags[flag] * kbpage, ((double) stats->flags[flag] / (double) stats->present) * 100.0);
+
+		// Older kernels only flag the head page of each free block
+		if (flag == KPF_BUDDY && stats->flags[flag] * 2 < freepages) printf(" block heads only, %" PRIu64 " kB free", freepages * kbpage);
+
+		printf("\n");
+	}
+
+	if (nzones == 0) return;
+
+	printf("============ Zones ============\n");
+	printf("====== Node Zone        Present       Free       Anon       File       Slab     Mapped ======\n");
+
+	memset(&total, 0, sizeof(total));
+
+	for (zone = 0; zone < nzones; zone++) {
+		printf("%11d %-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+		       zones[zone].node, zones[zone].name, stats->zones[zone].present * kbpage, zones[zone].free * kbpage,
+		       stats->zones[zone].anon * kbpage, stats->zones[zone].file * kbpage, stats->zones[zone].slab * kbpage,
+		       stats->zones[zone].mapped * kbpage);
+
+		total.present += stats->zones[zone].present;
+		nodefree += zones[zone].free;
+		total.anon += stats->zones[zone].anon;
+		total.file += stats->zones[zone].file;
+		total.slab += stats->zones[zone].slab;
+		total.mapped += stats->zones[zone].mapped;
+
+		if (zone + 1 == nzones || zones[zone + 1].node != zones[zone].node) {
+			// Node totals after its last zone
+			printf("%11d %-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+			       zones[zone].node, "Total", total.present * kbpage, nodefree * kbpage, total.anon * kbpage,
+			       total.file * kbpage, total.slab * kbpage, total.mapped * kbpage);
+
+			memset(&total, 0, sizeof(total));
+			nodefree = 0;
+		}
+	}
+}
+
+void decodeentries(struct global *globals, struct scanctx *ctx, uint64_t entries)
+{
+	ctx->ndata = globals->pmdecode(ctx->pmbuf, entries, ctx->pmdata, &ctx->pmcounts);
+}
+
+pmdecode_t pmdecode_probe()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) return pmdecode_avx2;
+	if (__builtin_cpu_supports("sse2")) return pmdecode_sse2;
+#endif
+
+	return pmdecode_scalar;
+}
+
+uint64_t pmdecode_scalar(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts)
+{
+	uint64_t idx;
+	uint64_t ndata = 0;
+
+	counts->present = 0;
+	counts->swapped = 0;
+
+	for (idx = 0; idx < count; idx++) {
+		if (entries[idx] & PM_PRESENT) ++counts->present;
+		else if (entries[idx] & PM_SWAPPED) ++counts->swapped;
+		else continue;
+
+		data[ndata++] = idx;
+	}
+
+	return ndata;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+uint64_t pmdecode_sse2(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts)
+{
+	__m128i vec[4];
+	__m128i any;
+	uint64_t idx;
+	uint64_t ndata = 0;
+	int present;
+	int swapped;
+	int mask;
+	int loop;
+
+	counts->present = 0;
+	counts->swapped = 0;
+
+	for (idx = 0; idx + 8 <= count; idx += 8) {
+		for (loop = 0; loop < 4; loop++) vec[loop] = _mm_loadu_si128((const __m128i *) (entries + idx + loop * 2));
+
+		// Skip eight not present entries at once, present is bit 63 and swapped bit 62
+		any = _mm_or_si128(_mm_or_si128(vec[0], vec[1]), _mm_or_si128(vec[2], vec[3]));
+		if ((_mm_movemask_pd(_mm_castsi128_pd(any)) | _mm_movemask_pd(_mm_castsi128_pd(_mm_slli_epi64(any, 1)))) == 0) continue;
+
+		for (loop = 0; loop < 4; loop++) {
+			// Sign bits of each pair of entries
+			present = _mm_movemask_pd(_mm_castsi128_pd(vec[loop]));
+			swapped = _mm_movemask_pd(_mm_castsi128_pd(_mm_slli_epi64(vec[loop], 1))) & ~present;
+
+			counts->present += __builtin_popcount(present);
+			counts->swapped += __builtin_popcount(swapped);
+
+			for (mask = present | swapped; mask != 0; mask &= mask - 1) {
+				data[ndata++] = idx + loop * 2 + __builtin_ctz(mask);
+			}
+		}
+	}
+
+	// Remaining entries
+	for (; idx < count; idx++) {
+		if (entries[idx] & PM_PRESENT) ++counts->present;
+		else if (entries[idx] & PM_SWAPPED) ++counts->swapped;
+		else continue;
+
+		data[ndata++] = idx;
+	}
+
+	return ndata;
+}
+
+__attribute__((target("avx2,popcnt")))
+uint64_t pmdecode_avx2(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts)
+{
+	__m256i vec[4];
+	__m256i any;
+	const __m256i bits = _mm256_set1_epi64x(PM_PRESENT | PM_SWAPPED);
+	uint64_t idx;
+	uint64_t ndata = 0;
+	int present;
+	int swapped;
+	int mask;
+	int loop;
+
+	counts->present = 0;
+	counts->swapped = 0;
+
+	for (idx = 0; idx + 16 <= count; idx += 16) {
+		for (loop = 0; loop < 4; loop++) vec[loop] = _mm256_loadu_si256((const __m256i *) (entries + idx + loop * 4));
+
+		// Skip sixteen not present entries at once
+		any = _mm256_or_si256(_mm256_or_si256(vec[0], vec[1]), _mm256_or_si256(vec[2], vec[3]));
+		if (_mm256_testz_si256(any, bits)) continue;
+
+		for (loop = 0; loop < 4; loop++) {
+			// Sign bits of each group of four entries, present is bit 63 and swapped bit 62
+			present = _mm256_movemask_pd(_mm256_castsi256_pd(vec[loop]));
+			swapped = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_slli_epi64(vec[loop], 1))) & ~present;
+
+			counts->present += __builtin_popcount(present);
+			counts->swapped += __builtin_popcount(swapped);
+
+			for (mask = present | swapped; mask != 0; mask &= mask - 1) {
+				data[ndata++] = idx + loop * 4 + __builtin_ctz(mask);
+			}
+		}
+	}
+
+	// Remaining entries
+	for (; idx < count; idx++) {
+		if (entries[idx] & PM_PRESENT) ++counts->present;
+		else if (entries[idx] & PM_SWAPPED) ++counts->swapped;
+		else continue;
+
+		data[ndata++] = idx;
+	}
+
+	return ndata;
+}
+
+#else
+
+uint64_t pmdecode_sse2(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts)
+{
+	return pmdecode_scalar(entries, count, data, counts);
+}
+
+uint64_t pmdecode_avx2(const uint64_t *entries, uint64_t count, uint64_t *data, struct pmcounts *counts)
+{
+	return pmdecode_scalar(entries, count, data, counts);
+}
+
+#endif
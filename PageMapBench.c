@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+// Return codes
+#define RET_OK 0
+#define RET_BADARG 1
+#define RET_TARGET 2
+#define RET_RUN 3
+
+// Default runs of each mode, the fastest is reported
+#define DEF_RUNS 5
+
+// Target layouts
+#define SPARSE_SIZE (64ULL << 30)
+#define SPARSE_STRIDE (4ULL << 20)
+#define DENSE_SIZE (512ULL << 20)
+#define THP_SIZE (512ULL << 20)
+#define THP_ALIGN (2ULL << 20)
+#define SWAP_SIZE (256ULL << 20)
+#define VMA_COUNT 20000
+#define THREAD_COUNT 64
+
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+// Synthetic target process
+struct target{
+	const char *name;
+	void (*build)();
+	pid_t pid;
+	uint64_t pages;
+};
+
+// PageMap options timed against each target
+struct mode{
+	const char *name;
+	const char *args[4];
+	bool threads;
+};
+
+// Results of one PageMap run
+struct runstats{
+	double secs;
+	uint64_t syscr;
+	uint64_t rchar;
+};
+
+void build_sparse();
+void build_dense();
+void build_thp();
+void build_swapped();
+void build_vmas();
+void build_threads();
+void *idle_thread(void *arg);
+pid_t target_start(struct target *target);
+uint64_t target_pages(pid_t pid);
+bool readio(pid_t pid, struct runstats *stats);
+bool runpagemap(const char *pagemap, const char **args, pid_t pid, bool tidarg, struct runstats *stats);
+void usage();
+
+struct target targets[] = {
+	{ "sparse", build_sparse, 0, 0 },
+	{ "dense", build_dense, 0, 0 },
+	{ "thp", build_thp, 0, 0 },
+	{ "swapped", build_swapped, 0, 0 },
+	{ "vmas", build_vmas, 0, 0 },
+	{ "threads", build_threads, 0, 0 },
+};
+
+struct mode modes[] = {
+	{ "totals", { NULL }, false },
+	{ "-s", { "-s", NULL }, false },
+	{ "-m", { "-m", NULL }, false },
+	{ "-v", { "-v", NULL }, false },
+	{ "-t", { NULL }, true },
+};
+
+int main(int argc, char **argv)
+{
+	const char *pagemap = "./PageMap";
+	const char *noargs[] = { NULL };
+	struct runstats best;
+	struct runstats run;
+	uint64_t runs = DEF_RUNS;
+	size_t ntargets = sizeof(targets) / sizeof(targets[0]);
+	size_t nmodes = sizeof(modes) / sizeof(modes[0]);
+	size_t target;
+	size_t mode;
+	uint64_t loop;
+	int result = RET_OK;
+	int opt;
+
+	while ((opt = getopt(argc, argv, ":hn:")) != -1){
+		switch (opt) {
+		case 'n':
+			runs = strtoull(optarg, NULL, 10);
+
+			if (runs == 0) {
+				fprintf(stderr, "Error: Invalid number of runs '%s'\n", optarg);
+				usage();
+				return RET_BADARG;
+			}
+
+			break;
+
+		default:
+			usage();
+			return RET_BADARG;
+
+		}
+	}
+
+	if (optind < argc) pagemap = argv[optind];
+
+	// Start the targets and let them settle
+	for (target = 0; target < ntargets; target++) {
+		if (target_start(&targets[target]) <= 0) {
+			fprintf(stderr, "Error: Unable to start %s target\n", targets[target].name);
+			result = RET_TARGET;
+			break;
+		}
+	}
+
+	if (result == RET_OK) {
+		// Read counters come from /proc/<pid>/io, which doesn't count ioctls
+		printf("====== Target   Mode            Pages      ms  Mpages/s read()s   MB read ======\n");
+
+		for (target = 0; target < ntargets && result == RET_OK; target++) {
+			for (mode = 0; mode < nmodes && result == RET_OK; mode++) {
+				// Fastest of the runs
+				for (loop = 0; loop < runs; loop++) {
+					if (!runpagemap(pagemap, modes[mode].args, targets[target].pid, modes[mode].threads, &run)) {
+						fprintf(stderr, "Error: %s failed on %s target\n", pagemap, targets[target].name);
+						result = RET_RUN;
+						break;
+					}
+
+					if (loop == 0 || run.secs < best.secs) best = run;
+				}
+
+				if (result != RET_OK) break;
+
+				printf("%13s   %-8s %12" PRIu64 " %7.1f %9.1f %7" PRIu64 " %9.1f\n", targets[target].name, modes[mode].name,
+				       targets[target].pages, best.secs * 1000.0, targets[target].pages / best.secs / 1000000.0, best.syscr,
+				       best.rchar / 1048576.0);
+			}
+		}
+
+		if (result == RET_OK) {
+			// All processes, including the targets
+			for (loop = 0; loop < runs; loop++) {
+				if (!runpagemap(pagemap, noargs, 0, false, &run)) {
+					result = RET_RUN;
+					break;
+				}
+
+				if (loop == 0 || run.secs < best.secs) best = run;
+			}
+
+			if (result == RET_OK) {
+				printf("%13s   %-8s %12s %7.1f %9s %7" PRIu64 " %9.1f\n", "all", "list", "-", best.secs * 1000.0, "-", best.syscr,
+				       best.rchar / 1048576.0);
+			}
+		}
+	}
+
+	// Stop the targets
+	for (target = 0; target < ntargets; target++) {
+		if (targets[target].pid > 0) {
+			kill(targets[target].pid, SIGKILL);
+			waitpid(targets[target].pid, NULL, 0);
+		}
+	}
+
+	return result;
+}
+
+void usage()
+{
+	printf("Usage: PageMapBench [-n <runs>] [<pagemap>]\n"
+	       "   where: -n <runs>   Runs of each mode, the fastest is reported (default %d)\n"
+	       "          <pagemap>   PageMap binary to time (default ./PageMap)\n"
+	       "          -h          Show this help\n"
+	       "   read()s and MB read only count read() calls, not PAGEMAP_SCAN ioctls\n", DEF_RUNS);
+}
+
+pid_t target_start(struct target *target)
+{
+	int ready[2];
+	char ch = 0;
+
+	if (pipe(ready) != 0) return -1;
+
+	target->pid = fork();
+
+	if (target->pid == 0) {
+		// Build the layout, tell the parent and wait to be killed
+		close(ready[0]);
+		target->build();
+		if (write(ready[1], &ch, 1) != 1) _exit(1);
+		for (;;) pause();
+	}
+
+	close(ready[1]);
+
+	if (target->pid > 0) {
+		if (read(ready[0], &ch, 1) != 1) {
+			waitpid(target->pid, NULL, 0);
+			target->pid = -1;
+		} else {
+			target->pages = target_pages(target->pid);
+		}
+	}
+
+	close(ready[0]);
+
+	return target->pid;
+}
+
+uint64_t target_pages(pid_t pid)
+{
+	char path[PATH_MAX + 1];
+	char line[512];
+	FILE *hmaps;
+	uint64_t start;
+	uint64_t end;
+	uint64_t pages = 0;
+
+	// Pages in all sections, as scanned by PageMap
+	sprintf(path, "/proc/%d/maps", (int) pid);
+	hmaps = fopen(path, "r");
+	if (hmaps == NULL) return 0;
+
+	while (fgets(line, sizeof(line), hmaps) != NULL) {
+		if (sscanf(line, "%" SCNx64 "-%" SCNx64, &start, &end) == 2) pages += (end - start) / getpagesize();
+	}
+
+	fclose(hmaps);
+
+	return pages;
+}
+
+bool readio(pid_t pid, struct runstats *stats)
+{
+	char path[PATH_MAX + 1];
+	char line[128];
+	FILE *hio;
+	int found = 0;
+
+	sprintf(path, "/proc/%d/io", (int) pid);
+	hio = fopen(path, "r");
+	if (hio == NULL) return false;
+
+	while (fgets(line, sizeof(line), hio) != NULL) {
+		if (sscanf(line, "rchar: %" SCNu64, &stats->rchar) == 1) ++found;
+		if (sscanf(line, "syscr: %" SCNu64, &stats->syscr) == 1) ++found;
+	}
+
+	fclose(hio);
+
+	return found == 2;
+}
+
+bool runpagemap(const char *pagemap, const char **args, pid_t pid, bool tidarg, struct runstats *stats)
+{
+	const char *argv[8];
+	char pidstr[16];
+	struct timespec start;
+	struct timespec end;
+	siginfo_t info;
+	pid_t child;
+	int status;
+	int argc = 0;
+	int fd;
+
+	// Command line for the run
+	sprintf(pidstr, "%d", (int) pid);
+	argv[argc++] = pagemap;
+
+	if (pid != 0) {
+		argv[argc++] = (tidarg ? "-t" : "-p");
+		argv[argc++] = pidstr;
+	}
+
+	while (*args != NULL) argv[argc++] = *args++;
+	argv[argc] = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	child = fork();
+	if (child < 0) return false;
+
+	if (child == 0) {
+		// Discard the output
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		execv(pagemap, (char * const *) argv);
+		_exit(127);
+	}
+
+	// Wait for the run to end, but read its I/O counters before reaping it
+	memset(&info, 0, sizeof(info));
+	if (waitid(P_PID, child, &info, WEXITED | WNOWAIT) != 0) return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	stats->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (!readio(child, stats)) stats->syscr = stats->rchar = 0;
+
+	waitpid(child, &status, 0);
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void build_sparse()
+{
+	char *mem;
+	uint64_t offset;
+
+	// Large reservation with one page touched every few MB
+	mem = (char *) mmap(NULL, SPARSE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) _exit(1);
+
+	madvise(mem, SPARSE_SIZE, MADV_NOHUGEPAGE);
+	for (offset = 0; offset < SPARSE_SIZE; offset += SPARSE_STRIDE) mem[offset] = 1;
+}
+
+void build_dense()
+{
+	char *mem;
+
+	// Fully touched small pages
+	mem = (char *) mmap(NULL, DENSE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) _exit(1);
+
+	madvise(mem, DENSE_SIZE, MADV_NOHUGEPAGE);
+	memset(mem, 1, DENSE_SIZE);
+}
+
+void build_thp()
+{
+	char *mem;
+	char *aligned;
+
+	// Huge page aligned region backed by transparent huge pages where possible
+	mem = (char *) mmap(NULL, THP_SIZE + THP_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) _exit(1);
+
+	aligned = (char *) (((uintptr_t) mem + THP_ALIGN - 1) & ~(THP_ALIGN - 1));
+	madvise(aligned, THP_SIZE, MADV_HUGEPAGE);
+	memset(aligned, 1, THP_SIZE);
+}
+
+void build_swapped()
+{
+	char *mem;
+
+	// Touched then paged out, stays present if there is no swap
+	mem = (char *) mmap(NULL, SWAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) _exit(1);
+
+	madvise(mem, SWAP_SIZE, MADV_NOHUGEPAGE);
+	memset(mem, 1, SWAP_SIZE);
+	madvise(mem, SWAP_SIZE / 2, MADV_PAGEOUT);
+}
+
+void build_vmas()
+{
+	char *mem;
+	int loop;
+	long pagesize = getpagesize();
+
+	// Many two page sections, alternating protection stops them merging
+	mem = (char *) mmap(NULL, VMA_COUNT * 2 * pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) _exit(1);
+
+	for (loop = 0; loop < VMA_COUNT; loop++) {
+		mem[loop * 2 * pagesize] = 1;
+		if (loop % 2) mprotect(mem + loop * 2 * pagesize, 2 * pagesize, PROT_READ);
+	}
+}
+
+void build_threads()
+{
+	pthread_t thread;
+	int loop;
+
+	// Idle threads, each with a stack
+	for (loop = 0; loop < THREAD_COUNT; loop++) {
+		if (pthread_create(&thread, NULL, idle_thread, NULL) != 0) _exit(1);
+	}
+}
+
+void *idle_thread(void *arg)
+{
+	(void) arg;
+
+	for (;;) pause();
+
+	return NULL;
+}